@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Compare the mirrored ring of queue.h with the plain one of queue_dyn.h, which
+# copies messages that straddle the end of the ring in two pieces.
+
+for header in queue.h queue_dyn.h;
+do
+    gcc -O2 -o test_layout -pthread -DQUEUE_HEADER="\"$header\"" test_layout.c
+
+    echo "$header"
+    for m in 1 4 16 100 500;
+    do
+        ./test_layout m$m b65536 p0 c1
+    done
+done
+
+rm -f test_layout
@@ -0,0 +1,19 @@
+#!/bin/bash
+
+# Compare the packed and the cache line partitioned queue_t layouts with the
+# producer pinned to cpu 0 and the consumer pinned to cpu 1.
+
+for header in queue_msg.h queue_spsc.h;
+do
+    gcc -O2 -o test_layout_packed -pthread -DQUEUE_PACKED_LAYOUT -DQUEUE_HEADER="\"$header\"" test_layout.c
+    gcc -O2 -o test_layout -pthread -DQUEUE_HEADER="\"$header\"" test_layout.c
+
+    echo "$header"
+    for m in 1 4 16 100;
+    do
+        ./test_layout_packed m$m b65536 p0 c1
+        ./test_layout m$m b65536 p0 c1
+    done
+done
+
+rm -f test_layout_packed test_layout
@@ -4,19 +4,23 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include "queue_layout.h"
+
 typedef struct {
-    // backing buffer and size
-    uint8_t *buffer;
+    // read-only after queue_init: backing buffer, its size and memfd
+    uint8_t *buffer queue_cacheline_aligned;
     size_t size;
-
-    // backing buffer's memfd descriptor
     int fd;
 
-    // read / write indices
-    size_t head, tail;
+    // producer-owned: write index
+    size_t tail queue_cacheline_aligned;
+
+    // consumer-owned: read index
+    size_t head queue_cacheline_aligned;
 
-    // synchronization primitives
-    pthread_cond_t readable, writeable;
+    // synchronization primitives, touched by both sides
+    pthread_cond_t readable queue_cacheline_aligned;
+    pthread_cond_t writeable;
     pthread_mutex_t lock;
 } queue_t;
 
@@ -141,7 +145,7 @@ void queue_put(queue_t *q, uint8_t **buffer, size_t size)
         pthread_cond_wait(&q->writeable, &q->lock);
 
     // Write message
-    memcpy(&q->buffer[q->tail], *buffer, sizeof(size_t));
+    memcpy(&q->buffer[q->tail], *buffer, size);
 
     // Increment write index
     q->tail += size;
@@ -166,7 +170,7 @@ size_t queue_get(queue_t *q, uint8_t **buffer, size_t size)
         pthread_cond_wait(&q->readable, &q->lock);
 
     // Read message body
-    memcpy(*buffer, &q->buffer[q->head], sizeof(size_t));
+    memcpy(*buffer, &q->buffer[q->head], size);
     // printf("%ld\n", (size_t) *(size_t *)buffer);
 
     // Consume the message by incrementing the read pointer
@@ -0,0 +1,392 @@
+#ifndef queue_bcast_h_
+#define queue_bcast_h_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "queue_layout.h"
+
+/* Every consumer reads every message through its own cursor, and the producer
+ * may only overwrite what the slowest cursor has passed.
+ */
+typedef struct {
+    // consumer-owned: read index, its offset into the buffer, the last write
+    // index this consumer has seen, its waiting flag and the tail it waits
+    // for, the current spin budget and how often it slept
+    size_t head queue_cacheline_aligned;
+    size_t head_off, cached_tail;
+    int waiting;
+    size_t wait_for;
+    uint32_t spin;
+    uint32_t times;
+} queue_cursor_t;
+
+typedef struct {
+    // read-only after queue_init: backing buffer, its size and memfd, the
+    // consumers' cursors and how long a side may spin before it goes to sleep
+    uint8_t *buffer queue_cacheline_aligned;
+    size_t size;
+    int fd;
+    queue_cursor_t *cursors;
+    unsigned int consumers;
+    uint32_t spin_limit;
+
+    // producer-owned: write index, its offset into the buffer, the slowest
+    // read index the producer has seen and the number of sleeping consumers
+    // (polled by the producer after every put), then the producer's own
+    // waiting flag, the head it waits for, spin budget and sleep count
+    size_t tail queue_cacheline_aligned;
+    size_t tail_off, cached_head;
+    int c_sleepers;
+    int p_waiting;
+    size_t p_wait_for;
+    uint32_t p_spin;
+    uint32_t p_times;
+} queue_t;
+
+#ifndef QUEUE_SPIN_LIMIT
+#define QUEUE_SPIN_LIMIT 4096
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+/* Convenience wrappers for erroring out */
+static inline void queue_error(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    abort();
+}
+static inline void queue_error_errno(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, " (errno %d)\n", errno);
+    va_end(args);
+    abort();
+}
+
+/** Initialize a single-producer broadcast queue *q* of size *s* that is read
+ * by *n* consumers, numbered 0 to n - 1
+ */
+void queue_init(queue_t *q, size_t s, unsigned int n)
+{
+    /* Same double mapping as queue.h: the second half of the virtual region
+     * points to the same physical memory as the first one, so a message
+     * never has to be split at the end of the buffer.
+     */
+
+    size_t real_mmap_size = ((s - 1 + getpagesize()) / getpagesize()) * getpagesize();
+
+    if (s % getpagesize() != 0) {
+        fprintf(stderr,
+            "Requested size (%lu) is not a multiple of the page size (%d),\n", s,
+            getpagesize());
+        fprintf(stderr, "Changing to %lu bytes.\n", real_mmap_size);
+    }
+
+    if (n == 0)
+        queue_error("A broadcast queue needs at least one consumer");
+
+    // Create an anonymous file backed by memory
+    if ((q->fd = memfd_create("queue_region", 0)) == -1)
+        queue_error_errno("Could not obtain anonymous file");
+
+    // Set buffer size
+    if (ftruncate(q->fd, real_mmap_size) != 0)
+        queue_error_errno("Could not set size of anonymous file");
+
+    // Ask mmap for a good address
+    if ((q->buffer = mmap(NULL, 2 * real_mmap_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0)) == MAP_FAILED)
+        queue_error_errno("Could not allocate virtual memory");
+
+    // Mmap first region
+    if (mmap(q->buffer, real_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             q->fd, 0) == MAP_FAILED)
+        queue_error_errno("Could not map buffer into virtual memory");
+
+    // Mmap second region, with exact address
+    if (mmap(q->buffer + real_mmap_size, real_mmap_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, q->fd, 0) == MAP_FAILED)
+        queue_error_errno("Could not map buffer into virtual memory");
+
+    // One cache line group per consumer
+    if (posix_memalign((void **) &q->cursors, QUEUE_CACHELINE_SIZE,
+                       n * sizeof(queue_cursor_t)) != 0)
+        queue_error("Could not allocate consumer cursors");
+
+    // Spinning only pays off when the other side runs on another cpu
+    q->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPIN_LIMIT : 0;
+
+    // Initialize remaining members
+    q->size = real_mmap_size;
+    q->consumers = n;
+    q->tail = q->tail_off = q->cached_head = 0;
+    q->c_sleepers = q->p_waiting = 0;
+    q->p_wait_for = 0;
+    q->p_spin = q->spin_limit;
+    q->p_times = 0;
+    for (unsigned int c = 0; c < n; c++) {
+        queue_cursor_t *cur = &q->cursors[c];
+        cur->head = cur->head_off = cur->cached_tail = 0;
+        cur->waiting = 0;
+        cur->wait_for = 0;
+        cur->spin = q->spin_limit;
+        cur->times = 0;
+    }
+}
+
+/** Destroy the queue *q* */
+void queue_destroy(queue_t *q)
+{
+    if (munmap(q->buffer + q->size, q->size) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (munmap(q->buffer, q->size) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (close(q->fd) != 0)
+        queue_error_errno("Could not close anonymous file");
+
+    free(q->cursors);
+}
+
+static inline void queue_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* The waiting flags double as the futex words: a side that goes to sleep sets
+ * its flag to 1 and waits on it, the other side clears it and wakes it up.
+ */
+static inline void queue_futex_wait(int *waiting)
+{
+    if (syscall(SYS_futex, waiting, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != EINTR)
+        queue_error_errno("Could not wait on futex");
+}
+
+/* Wake a sleeper on *waiting* if *index* has reached the value it waits for.
+ * The caller has a full fence between its index store and this call.
+ */
+static inline void queue_wake(int *waiting, size_t *wait_for, size_t index)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_ACQUIRE) &&
+        (ssize_t) (index - __atomic_load_n(wait_for, __ATOMIC_RELAXED)) >= 0 &&
+        __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED))
+        syscall(SYS_futex, waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Spin budgets adapt to how the last wait went: a wait that was satisfied
+ * while spinning allows a longer spin next time, one that ended up asleep
+ * halves it.
+ */
+static inline uint32_t queue_spin_adapt(queue_t *q, uint32_t spin, int slept)
+{
+    if (slept)
+        return spin / 2;
+    spin = spin ? spin * 2 : 1;
+    return spin < q->spin_limit ? spin : q->spin_limit;
+}
+
+/* The read index of the slowest consumer, which gates the producer */
+static inline size_t queue_min_head(queue_t *q)
+{
+    size_t min = __atomic_load_n(&q->cursors[0].head, __ATOMIC_ACQUIRE);
+    for (unsigned int c = 1; c < q->consumers; c++) {
+        size_t head = __atomic_load_n(&q->cursors[c].head, __ATOMIC_ACQUIRE);
+        if ((ssize_t) (head - min) < 0)
+            min = head;
+    }
+    return min;
+}
+
+/* Producer slow path: wait until *size* bytes are free after *tail* */
+static void queue_wait_writeable(queue_t *q, size_t tail, size_t size)
+{
+    for (uint32_t i = 0; i < q->p_spin; i++) {
+        queue_cpu_relax();
+        q->cached_head = queue_min_head(q);
+        if (q->size - (tail - q->cached_head) >= size) {
+            q->p_spin = queue_spin_adapt(q, q->p_spin, 0);
+            return;
+        }
+    }
+
+    __atomic_store_n(&q->p_wait_for, tail + size - q->size, __ATOMIC_RELAXED);
+    for (;;) {
+        __atomic_store_n(&q->p_waiting, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        q->cached_head = queue_min_head(q);
+        if (q->size - (tail - q->cached_head) >= size)
+            break;
+        q->p_times++;
+        queue_futex_wait(&q->p_waiting);
+    }
+    __atomic_store_n(&q->p_waiting, 0, __ATOMIC_RELAXED);
+    q->p_spin = queue_spin_adapt(q, q->p_spin, 1);
+}
+
+/* Consumer slow path: wait until *size* bytes are pending after the head of
+ * *cur*
+ */
+static void queue_wait_readable(queue_t *q, queue_cursor_t *cur, size_t size)
+{
+    size_t head = cur->head;
+
+    for (uint32_t i = 0; i < cur->spin; i++) {
+        queue_cpu_relax();
+        cur->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (cur->cached_tail - head >= size) {
+            cur->spin = queue_spin_adapt(q, cur->spin, 0);
+            return;
+        }
+    }
+
+    /* The sleeper count lets the producer skip looking at every cursor after
+     * every put while all consumers keep up.
+     */
+    __atomic_store_n(&cur->wait_for, head + size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&q->c_sleepers, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        __atomic_store_n(&cur->waiting, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        cur->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (cur->cached_tail - head >= size)
+            break;
+        cur->times++;
+        queue_futex_wait(&cur->waiting);
+    }
+    __atomic_store_n(&cur->waiting, 0, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&q->c_sleepers, 1, __ATOMIC_RELAXED);
+    cur->spin = queue_spin_adapt(q, cur->spin, 1);
+}
+
+/** Insert into queue *q* a message of *size* bytes from *buffer*
+ *
+ * Every consumer will see the message. Must only be called from the producer
+ * thread. Blocks until the slowest consumer has made room for it.
+ */
+void queue_put(queue_t *q, uint8_t **buffer, size_t size)
+{
+    size_t tail = q->tail;
+
+    if (size > q->size)
+        queue_error("Message size (%lu) exceeds queue size (%lu)", size, q->size);
+
+    // Only look at the cursors when our cached copy says we're full
+    if (q->size - (tail - q->cached_head) < size) {
+        q->cached_head = queue_min_head(q);
+        if (q->size - (tail - q->cached_head) < size)
+            queue_wait_writeable(q, tail, size);
+    }
+
+    // Write message, the mirrored second half takes care of wrapping
+    memcpy(&q->buffer[q->tail_off], *buffer, size);
+    *buffer += size;
+
+    q->tail_off += size;
+    if (q->tail_off >= q->size)
+        q->tail_off -= q->size;
+
+    // Publish the message
+    __atomic_store_n(&q->tail, tail + size, __ATOMIC_RELEASE);
+
+    // A sleeper raises the count before it checks the tail, and we check the
+    // count after the tail store, so no wake-up is lost
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->c_sleepers, __ATOMIC_RELAXED))
+        for (unsigned int c = 0; c < q->consumers; c++)
+            queue_wake(&q->cursors[c].waiting, &q->cursors[c].wait_for, tail + size);
+}
+
+/** Wait for at least *min* bytes for consumer *c* of queue *q* and return a
+ * read-only view of them in *ptr*
+ *
+ * Returns the number of bytes that can be read at *ptr*, which is everything
+ * this consumer has not read yet, capped at *max*. The bytes stay in the
+ * queue, for this consumer, until queue_release. Must only be called from the
+ * thread of consumer *c*.
+ */
+size_t queue_peek(queue_t *q, unsigned int c, const uint8_t **ptr, size_t min, size_t max)
+{
+    queue_cursor_t *cur = &q->cursors[c];
+    size_t head = cur->head;
+
+    if (min > q->size)
+        queue_error("Message size (%lu) exceeds queue size (%lu)", min, q->size);
+
+    // Only look at the producer's index when our cached copy says we're empty
+    if (cur->cached_tail - head < min) {
+        cur->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (cur->cached_tail - head < min)
+            queue_wait_readable(q, cur, min);
+    }
+
+    *ptr = &q->buffer[cur->head_off];
+    return cur->cached_tail - head < max ? cur->cached_tail - head : max;
+}
+
+/** Move the cursor of consumer *c* of queue *q* past *size* bytes
+ *
+ * The space goes back to the producer once every consumer has moved past it.
+ */
+void queue_release(queue_t *q, unsigned int c, size_t size)
+{
+    queue_cursor_t *cur = &q->cursors[c];
+
+    cur->head_off += size;
+    if (cur->head_off >= q->size)
+        cur->head_off -= q->size;
+
+    __atomic_store_n(&cur->head, cur->head + size, __ATOMIC_RELEASE);
+
+    // Only a waiting producer is worth a look at the other cursors
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->p_waiting, __ATOMIC_ACQUIRE))
+        queue_wake(&q->p_waiting, &q->p_wait_for, queue_min_head(q));
+}
+
+/** Retrieves the next message of *size* bytes for consumer *c* from queue *q*
+ * and writes it to *buffer*
+ *
+ * Must only be called from the thread of consumer *c*. Blocks until the
+ * message is available. Returns the number of bytes in the written message.
+ */
+size_t queue_get(queue_t *q, unsigned int c, uint8_t **buffer, size_t size)
+{
+    const uint8_t *msg;
+
+    // Read message body
+    queue_peek(q, c, &msg, size, size);
+    memcpy(*buffer, msg, size);
+    *buffer += size;
+
+    queue_release(q, c, size);
+
+    return size;
+}
+
+#endif
@@ -4,22 +4,27 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include "queue_layout.h"
+
 typedef struct {
-    // backing buffer and size
-    uint8_t *buffer;
+    // read-only after queue_init: backing buffer, its size and memfd
+    uint8_t *buffer queue_cacheline_aligned;
     size_t size;
-
-    // backing buffer's memfd descriptor
     int fd;
 
-    // read / write indices
-    size_t head, tail;
+    // producer-owned: write index and blocking counter
+    size_t tail queue_cacheline_aligned;
+    uint32_t p_times;
 
-    // synchronization primitives
-    pthread_cond_t readable, writeable;
-    pthread_mutex_t lock;
+    // consumer-owned: read index, shared output pointer and blocking counter
+    size_t head queue_cacheline_aligned;
     size_t **consumer_ptr;
-    uint32_t p_times, c_times;
+    uint32_t c_times;
+
+    // synchronization primitives, touched by both sides
+    pthread_cond_t readable queue_cacheline_aligned;
+    pthread_cond_t writeable;
+    pthread_mutex_t lock;
 } queue_t;
 
 #include <errno.h>
@@ -0,0 +1,164 @@
+#ifndef queue_copy_h_
+#define queue_copy_h_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Copy kernels for moving messages in and out of a ring, picked at runtime
+ * from what the cpu has: AVX-512, AVX2, SSE2, or libc memcpy elsewhere.
+ *
+ * queue_copy copies through the cache. queue_copy_stream is meant for the
+ * producer writing into the ring: at QUEUE_NT_THRESHOLD bytes and up it uses
+ * non-temporal stores, which go around the cache, so that a big message
+ * doesn't evict the producer's working set on its way to the consumer. It
+ * ends with a store fence, so a release store of the tail after it still
+ * publishes the message.
+ *
+ * queue_spsc.h uses them for queue_put and queue_get when built with
+ * -DQUEUE_COPY_KERNELS.
+ */
+
+#ifndef QUEUE_NT_THRESHOLD
+#define QUEUE_NT_THRESHOLD (256UL << 10)
+#endif
+
+/* Kernels for queue_copy_select */
+#define QUEUE_COPY_LIBC 0
+#define QUEUE_COPY_SSE2 1
+#define QUEUE_COPY_AVX2 2
+#define QUEUE_COPY_AVX512 3
+
+typedef void *(*queue_copy_fn_t)(void *dst, const void *src, size_t n);
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Every kernel moves four vectors per iteration and leaves the last partial
+ * block to memcpy, which handles short sizes well. The streaming ones first
+ * bring the destination up to vector alignment, which non-temporal stores
+ * need.
+ */
+#define QUEUE_COPY_KERNEL(name, isa, type, width, load, store, fence)                    \
+    __attribute__((target(isa))) static void *name(void *dst, const void *src, size_t n) \
+    {                                                                                    \
+        uint8_t *d = (uint8_t *) dst;                                                    \
+        const uint8_t *s = (const uint8_t *) src;                                        \
+        size_t head = fence ? -(uintptr_t) d & (width - 1) : 0;                          \
+                                                                                         \
+        if (n < head + 4 * width)                                                        \
+            return memcpy(dst, src, n);                                                  \
+        memcpy(d, s, head);                                                              \
+        d += head;                                                                       \
+        s += head;                                                                       \
+        n -= head;                                                                       \
+                                                                                         \
+        for (; n >= 4 * width; n -= 4 * width, d += 4 * width, s += 4 * width) {         \
+            type a = load((const type *) s);                                             \
+            type b = load((const type *) (s + width));                                   \
+            type c = load((const type *) (s + 2 * width));                               \
+            type e = load((const type *) (s + 3 * width));                               \
+            store((type *) d, a);                                                        \
+            store((type *) (d + width), b);                                              \
+            store((type *) (d + 2 * width), c);                                          \
+            store((type *) (d + 3 * width), e);                                          \
+        }                                                                                \
+        if (fence)                                                                       \
+            _mm_sfence();                                                                \
+                                                                                         \
+        memcpy(d, s, n);                                                                 \
+        return dst;                                                                      \
+    }
+
+QUEUE_COPY_KERNEL(queue_copy_sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_storeu_si128, 0)
+QUEUE_COPY_KERNEL(queue_copy_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_storeu_si256, 0)
+QUEUE_COPY_KERNEL(queue_copy_avx512, "avx512f", __m512i, 64, _mm512_loadu_si512,
+                  _mm512_storeu_si512, 0)
+QUEUE_COPY_KERNEL(queue_stream_sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_stream_si128, 1)
+QUEUE_COPY_KERNEL(queue_stream_avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_stream_si256,
+                  1)
+QUEUE_COPY_KERNEL(queue_stream_avx512, "avx512f", __m512i, 64, _mm512_loadu_si512,
+                  _mm512_stream_si512, 1)
+
+static const queue_copy_fn_t queue_copy_kernels[] = {memcpy, queue_copy_sse2, queue_copy_avx2,
+                                                     queue_copy_avx512};
+static const queue_copy_fn_t queue_stream_kernels[] = {memcpy, queue_stream_sse2,
+                                                       queue_stream_avx2, queue_stream_avx512};
+
+/* The best kernel this cpu runs */
+static int queue_copy_best(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return QUEUE_COPY_AVX512;
+    if (__builtin_cpu_supports("avx2"))
+        return QUEUE_COPY_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return QUEUE_COPY_SSE2;
+    return QUEUE_COPY_LIBC;
+}
+#else
+static const queue_copy_fn_t queue_copy_kernels[] = {memcpy};
+static const queue_copy_fn_t queue_stream_kernels[] = {memcpy};
+
+static int queue_copy_best(void)
+{
+    return QUEUE_COPY_LIBC;
+}
+#endif
+
+/* -1 until the first copy picks a kernel */
+static int queue_copy_kernel = -1;
+static size_t queue_nt_threshold = QUEUE_NT_THRESHOLD;
+
+/** Make queue_copy and queue_copy_stream use *kernel*, one of the
+ * QUEUE_COPY_* kernels, instead of the best one the cpu runs
+ *
+ * Returns 0, or -1 if the cpu or the build doesn't have it.
+ */
+int queue_copy_select(int kernel)
+{
+    if (kernel < 0 || kernel > queue_copy_best())
+        return -1;
+
+    __atomic_store_n(&queue_copy_kernel, kernel, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/** Make queue_copy_stream use non-temporal stores from *threshold* bytes on,
+ * (size_t) -1 turns them off
+ */
+void queue_copy_set_threshold(size_t threshold)
+{
+    __atomic_store_n(&queue_nt_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+static inline int queue_copy_kernel_get(void)
+{
+    int kernel = __atomic_load_n(&queue_copy_kernel, __ATOMIC_RELAXED);
+
+    if (__builtin_expect(kernel < 0, 0)) {
+        kernel = queue_copy_best();
+        __atomic_store_n(&queue_copy_kernel, kernel, __ATOMIC_RELAXED);
+    }
+    return kernel;
+}
+
+/** Copy *n* bytes from *src* to *dst* through the cache */
+static inline void *queue_copy(void *dst, const void *src, size_t n)
+{
+    return queue_copy_kernels[queue_copy_kernel_get()](dst, src, n);
+}
+
+/** Copy *n* bytes from *src* to *dst*, around the cache if there are at
+ * least as many as the non-temporal threshold
+ */
+static inline void *queue_copy_stream(void *dst, const void *src, size_t n)
+{
+    if (n < __atomic_load_n(&queue_nt_threshold, __ATOMIC_RELAXED))
+        return queue_copy(dst, src, n);
+
+    return queue_stream_kernels[queue_copy_kernel_get()](dst, src, n);
+}
+
+#endif
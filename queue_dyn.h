@@ -1,115 +1,177 @@
 #ifndef queue_dyn_h_
 #define queue_dyn_h_
 
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
 #include <pthread.h>
+#include <stdint.h>
+
+#include "queue_layout.h"
+
+/* The blocking queue of queue.h on a plain malloc'ed ring, for environments
+ * that don't allow the memfd / mmap double mapping. A message that straddles
+ * the end of the ring is copied in two pieces instead.
+ *
+ * The size is a power of two, so that offsets are the free running indices
+ * masked with size - 1 rather than taken modulo the size.
+ */
 
 typedef struct {
-    // representing buffer and its size
-    uint8_t *buffer;
+    // read-only after queue_init: backing buffer, its size and size - 1
+    uint8_t *buffer queue_cacheline_aligned;
     size_t size;
+    size_t mask;
 
-    // representing read and write indices
-    size_t head, tail;
+    // producer-owned: write index, never wrapped
+    size_t tail queue_cacheline_aligned;
 
-    // synchronization primitives
-    pthread_cond_t readable, writeable;
+    // consumer-owned: read index, never wrapped
+    size_t head queue_cacheline_aligned;
+
+    // synchronization primitives, touched by both sides
+    pthread_cond_t readable queue_cacheline_aligned;
+    pthread_cond_t writeable;
     pthread_mutex_t lock;
 } queue_t;
 
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Convenience wrappers for erroring out */
+static inline void queue_error(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    abort();
+}
+static inline void queue_error_errno(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, " (errno %d)\n", errno);
+    va_end(args);
+    abort();
+}
+
 /**
  * @brief allocate memory to initialize queue
- * 
+ *
  * @param q pointer to the queue itself
- * @param s size of queue
+ * @param s size of queue, rounded up to a power of two
  */
 void queue_init(queue_t *q, size_t s)
 {
-    // allocate a specific amount of memory for ring buffer
-    q->buffer = (uint8_t *)malloc(sizeof(uint8_t) * s);
-    if(!q->buffer) {
-        fprintf(stderr, "queue error: Couldn't allocate memory!\n");
-        abort();
+    size_t real_size = 1;
+
+    while (real_size < s)
+        real_size <<= 1;
+    if (real_size != s) {
+        fprintf(stderr, "Requested size (%lu) is not a power of two,\n", s);
+        fprintf(stderr, "Changing to %lu bytes.\n", real_size);
     }
 
+    // allocate a specific amount of memory for ring buffer
+    if (posix_memalign((void **) &q->buffer, QUEUE_CACHELINE_SIZE, real_size) != 0)
+        queue_error("Couldn't allocate memory!");
+
     // Initialize synchronization primitives
     if (pthread_mutex_init(&q->lock, NULL) != 0)
-        fprintf(stderr, "Could not initialize mutex");
+        queue_error_errno("Could not initialize mutex");
     if (pthread_cond_init(&q->readable, NULL) != 0)
-        fprintf(stderr, "Could not initialize condition variable");
+        queue_error_errno("Could not initialize condition variable");
     if (pthread_cond_init(&q->writeable, NULL) != 0)
-        fprintf(stderr, "Could not initialize condition variable");
-    
+        queue_error_errno("Could not initialize condition variable");
+
     // Initiallize buffer size and indices
-    q->size = s;
+    q->size = real_size;
+    q->mask = real_size - 1;
     q->head = q->tail = 0;
 }
 
 /**
  * @brief free the allocated memory in queue
  * and destroy mutex and condition variables
- * 
+ *
  * @param q pointer to the queue itself
  */
 void queue_destroy(queue_t *q)
 {
     free(q->buffer);
     if (pthread_mutex_destroy(&q->lock) != 0)
-        fprintf(stderr, "Could not destroy mutex");
+        queue_error_errno("Could not destroy mutex");
 
     if (pthread_cond_destroy(&q->readable) != 0)
-        fprintf(stderr, "Could not destroy condition variable");
+        queue_error_errno("Could not destroy condition variable");
 
     if (pthread_cond_destroy(&q->writeable) != 0)
-        fprintf(stderr, "Could not destroy condition variable");
+        queue_error_errno("Could not destroy condition variable");
 }
 
 /**
- * @brief insert the elements in @buffer to queue
- * 
+ * @brief insert the elements in @buffer to queue, blocking until there is
+ * room for all of them
+ *
  * @param q pointer to the queue itself
  * @param buffer pointer to the buffer inserting to queue
  * @param size size of the buffer
  */
 void queue_put(queue_t *q, uint8_t **buffer, size_t size)
 {
+    if (size > q->size)
+        queue_error("Message size (%lu) exceeds queue size (%lu)", size, q->size);
+
     pthread_mutex_lock(&q->lock);
 
-    while ((q->tail + size) % q->size == q->head)
+    while (q->size - (q->tail - q->head) < size)
         pthread_cond_wait(&q->writeable, &q->lock);
 
-    memcpy(&q->buffer[q->tail], *buffer, size);
-     // printf("put : %ld\n", *(size_t *) buffer);
+    // Copy up to the end of the ring, the rest goes to its start
+    size_t off = q->tail & q->mask;
+    size_t first = size < q->size - off ? size : q->size - off;
+    memcpy(&q->buffer[off], *buffer, first);
+    memcpy(q->buffer, *buffer + first, size - first);
+
     q->tail += size;
     *buffer += size;
-    q->tail %= q->size;
 
     pthread_cond_signal(&q->readable);
     pthread_mutex_unlock(&q->lock);
 }
 
 /**
- * @brief duplicate the content into the ring buffer
- * 
+ * @brief duplicate the content into the ring buffer, blocking until there
+ * are @size bytes to read
+ *
  * @param q pointer to the queue itself
  * @param buffer pointer to the duplicated content
- * @param max the size of duplicated content
- * @return size_t 
+ * @param size the size of duplicated content
+ * @return size_t
  */
 size_t queue_get(queue_t *q, uint8_t **buffer, size_t size)
 {
+    if (size > q->size)
+        queue_error("Message size (%lu) exceeds queue size (%lu)", size, q->size);
+
     pthread_mutex_lock(&q->lock);
 
-    while ((q->tail - q->head) == 0)
+    while (q->tail - q->head < size)
         pthread_cond_wait(&q->readable, &q->lock);
 
-    memcpy(*buffer, &q->buffer[q->head], size);
-    // printf("get : %ld\n", *(size_t *) buffer);
+    // Same two pieces as in queue_put
+    size_t off = q->head & q->mask;
+    size_t first = size < q->size - off ? size : q->size - off;
+    memcpy(*buffer, &q->buffer[off], first);
+    memcpy(*buffer + first, q->buffer, size - first);
+
     q->head += size;
     *buffer += size;
-    q->head %= q->size;
 
     pthread_cond_signal(&q->writeable);
     pthread_mutex_unlock(&q->lock);
@@ -117,4 +179,4 @@ size_t queue_get(queue_t *q, uint8_t **buffer, size_t size)
     return size;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,19 @@
+#ifndef queue_layout_h_
+#define queue_layout_h_
+
+/* The queue_t of the queues here is split into groups of fields that each
+ * start on their own cache line, so that the producer and the consumer don't
+ * keep stealing the same line from each other. Build with
+ * -DQUEUE_PACKED_LAYOUT to pack the fields back together, which is how
+ * test_layout.c and cnt_layout.sh measure what the split is worth.
+ */
+#ifndef QUEUE_CACHELINE_SIZE
+#define QUEUE_CACHELINE_SIZE 64
+#endif
+#ifdef QUEUE_PACKED_LAYOUT
+#define queue_cacheline_aligned
+#else
+#define queue_cacheline_aligned __attribute__((aligned(QUEUE_CACHELINE_SIZE)))
+#endif
+
+#endif
@@ -0,0 +1,402 @@
+#ifndef queue_lossy_h_
+#define queue_lossy_h_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "queue_layout.h"
+
+/* A lossy queue never makes the producer wait: when the ring is full it
+ * overwrites the oldest records. Consumers read every record through their
+ * own cursor, like in queue_bcast.h, but don't hold the producer back; one
+ * that falls behind finds its records gone, skips to the oldest one still in
+ * the ring and counts the ones it missed.
+ *
+ * Every record starts with its sequence number and length. The producer
+ * moves the oldest index past the records it is about to overwrite before it
+ * writes, so a consumer that still finds its record at or after the oldest
+ * index once it has copied it knows that the copy is good, like the reader
+ * of a seqlock.
+ */
+typedef struct {
+    // consumer-owned: read index, its offset into the buffer, the last write
+    // index this consumer has seen, its waiting flag and the tail it waits
+    // for, the current spin budget and how often it slept, then the sequence
+    // number of the next record it expects and how many it lost so far
+    size_t head queue_cacheline_aligned;
+    size_t head_off, cached_tail;
+    int waiting;
+    size_t wait_for;
+    uint32_t spin;
+    uint32_t times;
+    uint64_t seq;
+    uint64_t lost;
+} queue_cursor_t;
+
+typedef struct {
+    // read-only after queue_init: backing buffer, its size and memfd, the
+    // consumers' cursors and how long a consumer may spin before it goes to
+    // sleep
+    uint8_t *buffer queue_cacheline_aligned;
+    size_t size;
+    int fd;
+    queue_cursor_t *cursors;
+    unsigned int consumers;
+    uint32_t spin_limit;
+
+    // producer-owned: write index, its offset into the buffer, the index of
+    // the oldest record still in the ring and its offset, the sequence number
+    // of the next record, how many records were overwritten and the number of
+    // sleeping consumers (polled by the producer after every put)
+    size_t tail queue_cacheline_aligned;
+    size_t tail_off;
+    size_t oldest, oldest_off;
+    uint64_t seq;
+    uint64_t overwritten;
+    int c_sleepers;
+} queue_t;
+
+typedef struct {
+    uint64_t seq;
+    uint64_t len;
+} queue_record_t;
+
+#ifndef QUEUE_SPIN_LIMIT
+#define QUEUE_SPIN_LIMIT 4096
+#endif
+
+/* Records are padded to a multiple of 8 bytes, so that the next header is
+ * aligned again
+ */
+#define QUEUE_RECORD_HEADER sizeof(queue_record_t)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+/* Convenience wrappers for erroring out */
+static inline void queue_error(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    abort();
+}
+static inline void queue_error_errno(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, " (errno %d)\n", errno);
+    va_end(args);
+    abort();
+}
+
+/** Initialize a single-producer lossy queue *q* of size *s* that is read by
+ * *n* consumers, numbered 0 to n - 1
+ */
+void queue_init(queue_t *q, size_t s, unsigned int n)
+{
+    /* Same double mapping as queue.h: the second half of the virtual region
+     * points to the same physical memory as the first one, so a record never
+     * has to be split at the end of the buffer.
+     */
+
+    size_t real_mmap_size = ((s - 1 + getpagesize()) / getpagesize()) * getpagesize();
+
+    if (s % getpagesize() != 0) {
+        fprintf(stderr,
+            "Requested size (%lu) is not a multiple of the page size (%d),\n", s,
+            getpagesize());
+        fprintf(stderr, "Changing to %lu bytes.\n", real_mmap_size);
+    }
+
+    if (n == 0)
+        queue_error("A lossy queue needs at least one consumer");
+
+    // Create an anonymous file backed by memory
+    if ((q->fd = memfd_create("queue_region", 0)) == -1)
+        queue_error_errno("Could not obtain anonymous file");
+
+    // Set buffer size
+    if (ftruncate(q->fd, real_mmap_size) != 0)
+        queue_error_errno("Could not set size of anonymous file");
+
+    // Ask mmap for a good address
+    if ((q->buffer = mmap(NULL, 2 * real_mmap_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0)) == MAP_FAILED)
+        queue_error_errno("Could not allocate virtual memory");
+
+    // Mmap first region
+    if (mmap(q->buffer, real_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             q->fd, 0) == MAP_FAILED)
+        queue_error_errno("Could not map buffer into virtual memory");
+
+    // Mmap second region, with exact address
+    if (mmap(q->buffer + real_mmap_size, real_mmap_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED, q->fd, 0) == MAP_FAILED)
+        queue_error_errno("Could not map buffer into virtual memory");
+
+    // One cache line group per consumer
+    if (posix_memalign((void **) &q->cursors, QUEUE_CACHELINE_SIZE,
+                       n * sizeof(queue_cursor_t)) != 0)
+        queue_error("Could not allocate consumer cursors");
+
+    // Spinning only pays off when the other side runs on another cpu
+    q->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPIN_LIMIT : 0;
+
+    // Initialize remaining members
+    q->size = real_mmap_size;
+    q->consumers = n;
+    q->tail = q->tail_off = 0;
+    q->oldest = q->oldest_off = 0;
+    q->seq = q->overwritten = 0;
+    q->c_sleepers = 0;
+    for (unsigned int c = 0; c < n; c++) {
+        queue_cursor_t *cur = &q->cursors[c];
+        cur->head = cur->head_off = cur->cached_tail = 0;
+        cur->waiting = 0;
+        cur->wait_for = 0;
+        cur->spin = q->spin_limit;
+        cur->times = 0;
+        cur->seq = cur->lost = 0;
+    }
+}
+
+/** Destroy the queue *q* */
+void queue_destroy(queue_t *q)
+{
+    if (munmap(q->buffer + q->size, q->size) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (munmap(q->buffer, q->size) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (close(q->fd) != 0)
+        queue_error_errno("Could not close anonymous file");
+
+    free(q->cursors);
+}
+
+static inline void queue_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* The waiting flags double as the futex words: a consumer that goes to sleep
+ * sets its flag to 1 and waits on it, the producer clears it and wakes it up.
+ */
+static inline void queue_futex_wait(int *waiting)
+{
+    if (syscall(SYS_futex, waiting, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != EINTR)
+        queue_error_errno("Could not wait on futex");
+}
+
+/* Wake a sleeper on *waiting* if *index* has reached the value it waits for.
+ * The caller has a full fence between its index store and this call.
+ */
+static inline void queue_wake(int *waiting, size_t *wait_for, size_t index)
+{
+    if (__atomic_load_n(waiting, __ATOMIC_ACQUIRE) &&
+        (ssize_t) (index - __atomic_load_n(wait_for, __ATOMIC_RELAXED)) >= 0 &&
+        __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED))
+        syscall(SYS_futex, waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/* Spin budgets adapt to how the last wait went: a wait that was satisfied
+ * while spinning allows a longer spin next time, one that ended up asleep
+ * halves it.
+ */
+static inline uint32_t queue_spin_adapt(queue_t *q, uint32_t spin, int slept)
+{
+    if (slept)
+        return spin / 2;
+    spin = spin ? spin * 2 : 1;
+    return spin < q->spin_limit ? spin : q->spin_limit;
+}
+
+static inline size_t queue_record_size(size_t len)
+{
+    return (QUEUE_RECORD_HEADER + len + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+/* Consumer slow path: wait until the tail has moved past *head* */
+static void queue_wait_readable(queue_t *q, queue_cursor_t *cur, size_t head)
+{
+    for (uint32_t i = 0; i < cur->spin; i++) {
+        queue_cpu_relax();
+        cur->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (cur->cached_tail != head) {
+            cur->spin = queue_spin_adapt(q, cur->spin, 0);
+            return;
+        }
+    }
+
+    /* The sleeper count lets the producer skip looking at every cursor after
+     * every put while all consumers keep up.
+     */
+    __atomic_store_n(&cur->wait_for, head + 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&q->c_sleepers, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        __atomic_store_n(&cur->waiting, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        cur->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (cur->cached_tail != head)
+            break;
+        cur->times++;
+        queue_futex_wait(&cur->waiting);
+    }
+    __atomic_store_n(&cur->waiting, 0, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&q->c_sleepers, 1, __ATOMIC_RELAXED);
+    cur->spin = queue_spin_adapt(q, cur->spin, 1);
+}
+
+/** Insert into queue *q* a record of *size* bytes from *buffer*
+ *
+ * Every consumer that keeps up will see the record. Never blocks: if the
+ * ring is full, the oldest records make room for it. Must only be called
+ * from the producer thread.
+ */
+void queue_put(queue_t *q, uint8_t **buffer, size_t size)
+{
+    size_t tail = q->tail;
+    size_t rec_size = queue_record_size(size);
+
+    if (rec_size > q->size)
+        queue_error("Record size (%lu) exceeds queue size (%lu)", size, q->size);
+
+    // Drop the oldest records until the new one fits. Their headers are our
+    // own writes, so we can read them without care.
+    if (q->size - (tail - q->oldest) < rec_size) {
+        size_t oldest = q->oldest;
+        do {
+            size_t len = ((queue_record_t *) &q->buffer[q->oldest_off])->len;
+            oldest += queue_record_size(len);
+            q->oldest_off += queue_record_size(len);
+            if (q->oldest_off >= q->size)
+                q->oldest_off -= q->size;
+            q->overwritten++;
+        } while (q->size - (tail - oldest) < rec_size);
+
+        // Consumers must see the new oldest index before any of the bytes
+        // that overwrite the records it skips
+        __atomic_store_n(&q->oldest, oldest, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+
+    // Write record, the mirrored second half takes care of wrapping
+    queue_record_t *rec = (queue_record_t *) &q->buffer[q->tail_off];
+    __atomic_store_n(&rec->seq, q->seq++, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->len, size, __ATOMIC_RELAXED);
+    memcpy(rec + 1, *buffer, size);
+    *buffer += size;
+
+    q->tail_off += rec_size;
+    if (q->tail_off >= q->size)
+        q->tail_off -= q->size;
+
+    // Publish the record
+    __atomic_store_n(&q->tail, tail + rec_size, __ATOMIC_RELEASE);
+
+    // A sleeper raises the count before it checks the tail, and we check the
+    // count after the tail store, so no wake-up is lost
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->c_sleepers, __ATOMIC_RELAXED))
+        for (unsigned int c = 0; c < q->consumers; c++)
+            queue_wake(&q->cursors[c].waiting, &q->cursors[c].wait_for, tail + rec_size);
+}
+
+/* Whether the record at *head* may have been overwritten since the caller
+ * read it
+ */
+static inline int queue_overrun(queue_t *q, size_t head)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (ssize_t) (head - __atomic_load_n(&q->oldest, __ATOMIC_RELAXED)) < 0;
+}
+
+/** Retrieves the next record for consumer *c* from queue *q* and writes it to
+ * *buffer*, which holds *size* bytes
+ *
+ * If the producer has overwritten the record this consumer was due to read,
+ * it goes on with the oldest record still in the queue and counts the ones in
+ * between as lost, see queue_lost. Must only be called from the thread of
+ * consumer *c*. Blocks until there is a record. Returns the number of bytes in
+ * the written record.
+ */
+size_t queue_get(queue_t *q, unsigned int c, uint8_t **buffer, size_t size)
+{
+    queue_cursor_t *cur = &q->cursors[c];
+
+    for (;;) {
+        size_t head = cur->head;
+
+        // Skip to the oldest record if ours is gone
+        size_t oldest = __atomic_load_n(&q->oldest, __ATOMIC_ACQUIRE);
+        if ((ssize_t) (head - oldest) < 0) {
+            head = cur->head = oldest;
+            cur->head_off = oldest % q->size;
+        }
+
+        // Only look at the producer's index when our cached copy says we're empty
+        if ((ssize_t) (cur->cached_tail - head) <= 0) {
+            cur->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+            if (cur->cached_tail == head)
+                queue_wait_readable(q, cur, head);
+            continue;
+        }
+
+        // Read the header, and only trust its length once it is known to be
+        // whole
+        const queue_record_t *rec = (const queue_record_t *) &q->buffer[cur->head_off];
+        uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+        size_t len = __atomic_load_n(&rec->len, __ATOMIC_RELAXED);
+        if (queue_overrun(q, head))
+            continue;
+        if (len > size)
+            queue_error("Record size (%lu) exceeds buffer size (%lu)", len, size);
+
+        memcpy(*buffer, rec + 1, len);
+        if (queue_overrun(q, head))
+            continue;
+
+        *buffer += len;
+        cur->lost += seq - cur->seq;
+        cur->seq = seq + 1;
+
+        cur->head_off += queue_record_size(len);
+        if (cur->head_off >= q->size)
+            cur->head_off -= q->size;
+        __atomic_store_n(&cur->head, head + queue_record_size(len), __ATOMIC_RELAXED);
+
+        return len;
+    }
+}
+
+/** The number of records consumer *c* of queue *q* lost to the producer so
+ * far
+ */
+uint64_t queue_lost(queue_t *q, unsigned int c)
+{
+    return q->cursors[c].lost;
+}
+
+#endif
@@ -4,36 +4,54 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include "queue_layout.h"
+
+/* Every message lives in its own fixed-size slot. The slot's sequence number
+ * says whose turn it is: seq == pos means free for the producer claiming
+ * position pos, seq == pos + 1 means filled for the consumer claiming pos.
+ * waiters counts the threads asleep on seq.
+ */
 typedef struct {
-    // backing buffer and size
-    uint8_t *buffer;
-    size_t size;
+    size_t seq;
+    size_t len;
+    size_t waiters;
+    uint8_t data[];
+} queue_slot_t;
 
-    // backing buffer's memfd descriptor
+typedef struct {
+    // read-only after queue_init: backing buffer, its size and memfd
+    uint8_t *buffer queue_cacheline_aligned;
+    size_t size;
     int fd;
 
-    // read / write indices
-    size_t head, tail;
+    // backing message size, slot layout and spin budget before sleeping
+    size_t msg_size;
+    size_t slot_size, mask;
+    uint32_t spin_limit;
 
-    // synchronization primitives
-    pthread_cond_t readable, writeable;
-    pthread_mutex_t lock;
-    size_t **consumer_ptr;
-    // uint32_t p_times, c_times;
+    // producer-owned: next position to claim
+    size_t tail queue_cacheline_aligned;
 
-    // backing message size
-    size_t msg_size;
+    // consumer-owned: next position to claim
+    size_t head queue_cacheline_aligned;
 } queue_t;
 
+#ifndef QUEUE_SPIN_LIMIT
+#define QUEUE_SPIN_LIMIT 1024
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <linux/futex.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
 /* Convenience wrappers for erroring out */
@@ -44,6 +62,8 @@ static inline void queue_error(const char *fmt, ...)
     fprintf(stderr, "queue error: ");
     vfprintf(stderr, fmt, args);
     fprintf(stderr, "\n");
+    va_end(args);
+    abort();
 }
 static inline void queue_error_errno(const char *fmt, ...)
 {
@@ -56,28 +76,28 @@ static inline void queue_error_errno(const char *fmt, ...)
     abort();
 }
 
-/** Initialize a blocking queue *q* of size *s* */
+/** Initialize a multi-producer / multi-consumer queue *q* of at least *s*
+ * bytes, holding messages of up to *m* size_t's each
+ */
 void queue_init(queue_t *q, size_t s, size_t m)
 {
-    /* We mmap two adjacent pages (in virtual memory) that point to the same
-     * physical memory. This lets us optimize memory access, so that we don't
-     * need to even worry about wrapping our pointers around until we go
-     * through the entire buffer.
+    /* Messages are claimed slot by slot instead of byte by byte, so nothing
+     * ever wraps and a single mapping of the memfd is enough. The number of
+     * slots is rounded up to a power of two (and at least two) so positions
+     * can be turned into slots with a mask.
      */
 
-    size_t real_mmap_size;
-    size_t real_mmap = 0;
-    size_t buffer_algin = ((s - 1 + getpagesize()) / getpagesize()) * getpagesize();
-    if(m * sizeof(size_t) * 2 > getpagesize())
-        real_mmap = ((m * 2 * sizeof(size_t) - 1 + getpagesize()) / getpagesize()) * getpagesize();
-    printf("real_mmap = %lu, buffer_algin = %lu\n", real_mmap, buffer_algin);
+    size_t slot_size = sizeof(queue_slot_t) + m * sizeof(size_t);
+    slot_size = (slot_size + QUEUE_CACHELINE_SIZE - 1) & ~(size_t) (QUEUE_CACHELINE_SIZE - 1);
 
-    real_mmap_size =  real_mmap > buffer_algin ? real_mmap : buffer_algin;
+    size_t slots = 2;
+    while (slots * slot_size < s)
+        slots *= 2;
+
+    size_t real_mmap_size = ((slots * slot_size - 1 + getpagesize()) / getpagesize()) * getpagesize();
 
-    // Check that the requested size is a multiple of a page. If it isn't, we're
-    // in trouble.
     if (s % getpagesize() != 0) {
-        fprintf(stderr, 
+        fprintf(stderr,
             "Requested size (%lu) is not a multiple of the page size (%d),\n", s,
             getpagesize());
         fprintf(stderr, "Changing to %lu bytes.\n", real_mmap_size);
@@ -91,128 +111,182 @@ void queue_init(queue_t *q, size_t s, size_t m)
     if (ftruncate(q->fd, real_mmap_size) != 0)
         queue_error_errno("Could not set size of anonymous file");
 
-    // Ask mmap for a good address
-    if ((q->buffer = mmap(NULL, real_mmap_size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
-                          -1, 0)) == MAP_FAILED)
-        queue_error_errno("Could not allocate virtual memory");
-
-    // Mmap first region
-    if (mmap(q->buffer, real_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
-             q->fd, 0) == MAP_FAILED)
-        queue_error_errno("Could not map buffer into first virtual memory");
-
-    // Mmap second region, with exact address
-    if (mmap(q->buffer + real_mmap_size, real_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
-             q->fd, 0) == MAP_FAILED)
-        queue_error_errno("Could not map buffer into second virtual memory");
-
-    // Initialize synchronization primitives
-    if (pthread_mutex_init(&q->lock, NULL) != 0)
-        queue_error_errno("Could not initialize mutex");
-    if (pthread_cond_init(&q->readable, NULL) != 0)
-        queue_error_errno("Could not initialize condition variable");
-    if (pthread_cond_init(&q->writeable, NULL) != 0)
-        queue_error_errno("Could not initialize condition variable");
+    // Mmap the slots
+    if ((q->buffer = mmap(NULL, real_mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          q->fd, 0)) == MAP_FAILED)
+        queue_error_errno("Could not map buffer into virtual memory");
+
+    // Every slot starts out free for the producer of the first lap
+    for (size_t i = 0; i < slots; i++) {
+        ((queue_slot_t *) (q->buffer + i * slot_size))->seq = i;
+        ((queue_slot_t *) (q->buffer + i * slot_size))->waiters = 0;
+    }
+
+    // Spinning only pays off when the other side runs on another cpu
+    q->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPIN_LIMIT : 0;
 
     // Initialize remaining members
     q->size = real_mmap_size;
-    q->head = q->tail = 0;
     q->msg_size = m;
-    // q->head = q->tail = q->p_times = q->c_times = 0;
-    q->consumer_ptr = malloc(sizeof(size_t *));
-    if(!q->consumer_ptr)
-        fprintf(stderr, "couldn't allocate comsumer pointer\n");
+    q->slot_size = slot_size;
+    q->mask = slots - 1;
+    q->head = q->tail = 0;
 }
 
-/** Destroy the blocking queue *q* */
+/** Destroy the queue *q* */
 void queue_destroy(queue_t *q)
 {
-    if (munmap(q->buffer + q->size, q->size) != 0)
-        queue_error_errno("Could not unmap buffer");
-
     if (munmap(q->buffer, q->size) != 0)
         queue_error_errno("Could not unmap buffer");
 
     if (close(q->fd) != 0)
         queue_error_errno("Could not close anonymous file");
+}
+
+static inline queue_slot_t *queue_slot(queue_t *q, size_t pos)
+{
+    return (queue_slot_t *) (q->buffer + (pos & q->mask) * q->slot_size);
+}
+
+static inline void queue_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
 
-    if (pthread_mutex_destroy(&q->lock) != 0)
-        queue_error_errno("Could not destroy mutex");
+/* Futexes are the low 32 bits of the slot sequence numbers */
+static inline uint32_t *queue_futex_word(size_t *seq)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (uint32_t *) seq + (sizeof(size_t) / sizeof(uint32_t) - 1);
+#else
+    return (uint32_t *) seq;
+#endif
+}
+
+/* Sleep until the sequence number of *slot* is no longer *seen*.
+ *
+ * The slot's waiter count is raised before the sequence number is checked
+ * again, and the other side bumps the sequence number before it checks the
+ * count, so at least one of them sees the other's update and no wake-up is
+ * lost.
+ */
+static void queue_wait_slot(queue_t *q, queue_slot_t *slot, size_t seen)
+{
+    for (uint32_t i = 0; i < q->spin_limit; i++) {
+        queue_cpu_relax();
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seen)
+            return;
+    }
 
-    if (pthread_cond_destroy(&q->readable) != 0)
-        queue_error_errno("Could not destroy condition variable");
+    __atomic_add_fetch(&slot->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == seen &&
+        syscall(SYS_futex, queue_futex_word(&slot->seq), FUTEX_WAIT_PRIVATE,
+                (uint32_t) seen, NULL, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != EINTR)
+        queue_error_errno("Could not wait on futex");
+    __atomic_sub_fetch(&slot->waiters, 1, __ATOMIC_RELAXED);
+}
 
-    if (pthread_cond_destroy(&q->writeable) != 0)
-        queue_error_errno("Could not destroy condition variable");
+/* Hand *slot* over to the other side by setting its sequence number to *seq*.
+ *
+ * Only threads asleep on this very slot are woken. All of them are, because
+ * the ones that lose the race for the slot have to move on to the next one
+ * rather than stay asleep here.
+ */
+static inline void queue_publish_slot(queue_slot_t *slot, size_t seq)
+{
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->waiters, __ATOMIC_RELAXED))
+        syscall(SYS_futex, queue_futex_word(&slot->seq), FUTEX_WAKE_PRIVATE,
+                INT_MAX, NULL, NULL, 0);
 }
 
 /** Insert into queue *q* a message of *size* bytes from *buffer*
  *
- * Blocks until sufficient space is available in the queue.
+ * Safe to call from any number of producer threads. Blocks until a slot is
+ * free.
  */
 void queue_put(queue_t *q, uint8_t **buffer, size_t size)
 {
-    pthread_mutex_lock(&q->lock);
-
-    // Wait for space to become available
-    while ((q->size - (q->tail - q->head)) < (size + sizeof(size_t))) {
-        // q->p_times++;
-        printf("publisher blocked...\n");
-        pthread_cond_wait(&q->writeable, &q->lock);
+    queue_slot_t *slot;
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+    if (size > q->msg_size * sizeof(size_t))
+        queue_error("Message size (%lu) exceeds slot size (%lu)", size,
+                    q->msg_size * sizeof(size_t));
+
+    // Claim the slot at tail once the consumers of the previous lap freed it
+    for (;;) {
+        slot = queue_slot(q, pos);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        ssize_t diff = (ssize_t) (seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            queue_wait_slot(q, slot, seq);
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
     }
 
     // Write message
-    printf("queue_put for size = %lu, q->head = %lu, q->tail = %lu\n", size, q->head, q->tail);
-    memcpy(&q->buffer[q->tail], *buffer, size);
-    // printf("%ld\n", (size_t) **(size_t **)buffer);
-    
-
-    // Increment write index and buffer index
-    q->tail += size;
+    memcpy(slot->data, *buffer, size);
+    slot->len = size;
     *buffer += size;
-    // printf("After queue_put for size = %lu, q->head = %lu, q->tail = %lu\n", size, q->head, q->tail);
 
-    pthread_cond_signal(&q->readable);
-    pthread_mutex_unlock(&q->lock);
+    queue_publish_slot(slot, pos + 1);
 }
 
-/** Retrieves a message of at most *max* bytes from queue *q* and writes
+/** Retrieves a message of at most *size* bytes from queue *q* and writes
  * it to *buffer*.
  *
- * Returns the number of bytes in the written message.
+ * Safe to call from any number of consumer threads. Blocks until a message is
+ * available. Returns the number of bytes in the written message.
  */
 size_t queue_get(queue_t *q, uint8_t **buffer, size_t size)
 {
-    printf("start queue_get\n");
-    pthread_mutex_lock(&q->lock);
-
-    // Wait for a message that we can successfully consume to reach the front of
-    // the queue
-    while ((q->tail < q->head + size)) {
-        // q->c_times++;
-        printf("consumer blocked...\n");
-        pthread_cond_wait(&q->readable, &q->lock);
+    queue_slot_t *slot;
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+    // Claim the slot at head once its producer filled it
+    for (;;) {
+        slot = queue_slot(q, pos);
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        ssize_t diff = (ssize_t) (seq - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            queue_wait_slot(q, slot, seq);
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+        }
     }
-    printf("start memcpy\n\n");
-    // Read message body
-    printf("queue_get for size = %lu, q->head = %lu, q->tail = %lu\n", size, q->head, q->tail);
-    memcpy(*buffer, &q->buffer[q->head], size);
 
-    // Consume the message by incrementing the read pointer
-    q->head += size;
-    *buffer += size;
-    // printf("After queue_get for size = %lu, q->head = %lu, q->tail = %lu\n", size, q->head, q->tail);
+    if (slot->len > size)
+        queue_error("Message size (%lu) exceeds buffer size (%lu)", slot->len, size);
 
-    // When read buffer moves into 2nd memory region, we can reset to the 1st
-    // region
-    if (q->head >= q->size) {
-        q->head -= q->size; q->tail -= q->size;
-    }
+    // Read message body
+    size = slot->len;
+    memcpy(*buffer, slot->data, size);
+    *buffer += size;
 
-    pthread_cond_signal(&q->writeable);
-    pthread_mutex_unlock(&q->lock);
+    // Free the slot for the producer of the next lap
+    queue_publish_slot(slot, pos + q->mask + 1);
 
     return size;
 }
 
-#endif
\ No newline at end of file
+#endif
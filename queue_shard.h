@@ -0,0 +1,192 @@
+#ifndef queue_shard_h_
+#define queue_shard_h_
+
+#include "queue_spsc.h"
+
+/* A sharded queue is an array of QUEUE_FRAMED queue_spsc.h rings behind one
+ * handle, one ring per producer, so producers never share anything. Every
+ * consumer has home shards it drains first and steals from the other shards
+ * when those are empty. A shard is only ever read by one consumer at a time,
+ * which a try-lock next to it takes care of, so each ring keeps its single
+ * consumer.
+ *
+ * Messages from one producer come out in order; there is no order between
+ * producers.
+ */
+typedef struct {
+    queue_t q;
+
+    // consumer try-lock, taken for the length of one queue_get
+    int busy queue_cacheline_aligned;
+} queue_shard_t;
+
+typedef struct {
+    // read-only after queue_sharded_init: the shards, one per producer, and
+    // the number of consumers
+    queue_shard_t *shards queue_cacheline_aligned;
+    unsigned int num_shards;
+    unsigned int num_consumers;
+
+    // consumers that found every shard empty sleep on the event counter,
+    // which producers bump after a put while the sleeper count is non-zero
+    uint32_t events queue_cacheline_aligned;
+    int sleepers;
+} queue_sharded_t;
+
+/** Initialize a sharded queue *sq* of *producers* rings of size *s* each, read
+ * by *consumers* consumers
+ *
+ * Producers and consumers are numbered from 0 and each thread must stick to
+ * its own number.
+ */
+void queue_sharded_init(queue_sharded_t *sq, size_t s, unsigned int producers,
+                        unsigned int consumers)
+{
+    if (producers == 0 || consumers == 0)
+        queue_error("A sharded queue needs at least one producer and one consumer");
+
+    if (posix_memalign((void **) &sq->shards, QUEUE_CACHELINE_SIZE,
+                       producers * sizeof(queue_shard_t)) != 0)
+        queue_error("Could not allocate shards");
+
+    for (unsigned int i = 0; i < producers; i++) {
+        queue_init_flags(&sq->shards[i].q, s, QUEUE_FRAMED);
+        sq->shards[i].busy = 0;
+    }
+
+    sq->num_shards = producers;
+    sq->num_consumers = consumers;
+    sq->events = 0;
+    sq->sleepers = 0;
+}
+
+/** Destroy the sharded queue *sq* */
+void queue_sharded_destroy(queue_sharded_t *sq)
+{
+    for (unsigned int i = 0; i < sq->num_shards; i++)
+        queue_destroy(&sq->shards[i].q);
+
+    free(sq->shards);
+}
+
+/** Insert a message of *size* bytes from *buffer* into the shard of producer
+ * *p* of *sq*
+ *
+ * Must only be called from the thread of producer *p*. Blocks until there is
+ * room in its shard.
+ */
+void queue_sharded_put(queue_sharded_t *sq, unsigned int p, uint8_t **buffer, size_t size)
+{
+    queue_put(&sq->shards[p].q, buffer, size);
+
+    // A sleeper raises the count before it looks at the shards, and we check
+    // it after publishing, so no wake-up is lost. queue_put already has a
+    // full fence between its tail store and its own waiter check.
+    if (__atomic_load_n(&sq->sleepers, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&sq->events, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &sq->events, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/* Take one message of at most *size* bytes out of *shard* into *buffer* if it
+ * has one and no other consumer is at it. Returns 1 and the length of the
+ * message in *len* if it did, 0 if the shard is empty and -1 if another
+ * consumer has it.
+ */
+static int queue_shard_try_get(queue_shard_t *shard, uint8_t **buffer, size_t size, size_t *len)
+{
+    queue_ctl_t *ctl = shard->q.ctl;
+    int got = 0;
+
+    // Look before taking the lock, empty shards are the common case when stealing
+    if (__atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&ctl->head, __ATOMIC_RELAXED))
+        return 0;
+
+    if (__atomic_load_n(&shard->busy, __ATOMIC_RELAXED) ||
+        __atomic_exchange_n(&shard->busy, 1, __ATOMIC_ACQUIRE))
+        return -1;
+
+    // Records are committed whole, so queue_get won't block here
+    if (__atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE) != ctl->head) {
+        *len = queue_get(&shard->q, buffer, size);
+        got = 1;
+    }
+
+    __atomic_store_n(&shard->busy, 0, __ATOMIC_RELEASE);
+    return got;
+}
+
+/* One pass over the shards for consumer *c*: its home shards (those whose
+ * number is c modulo the number of consumers) first, then the others,
+ * starting with shard c modulo the number of shards, so that a consumer
+ * without home shards still visits every shard. Returns 1 if it got a
+ * message, 0 if every shard was empty and -1 if some were only busy.
+ */
+static int queue_sharded_try_get(queue_sharded_t *sq, unsigned int c, uint8_t **buffer,
+                                 size_t size, size_t *len)
+{
+    int ret, busy = 0;
+
+    for (unsigned int i = c; i < sq->num_shards; i += sq->num_consumers) {
+        if ((ret = queue_shard_try_get(&sq->shards[i], buffer, size, len)) == 1)
+            return 1;
+        busy |= ret;
+    }
+
+    for (unsigned int k = 0; k < sq->num_shards; k++) {
+        unsigned int i = (c + k) % sq->num_shards;
+        if (i % sq->num_consumers == c)
+            continue;
+        if ((ret = queue_shard_try_get(&sq->shards[i], buffer, size, len)) == 1)
+            return 1;
+        busy |= ret;
+    }
+
+    return busy;
+}
+
+/** Retrieve a message of at most *size* bytes from *sq* for consumer *c* and
+ * write it to *buffer*
+ *
+ * Must only be called from the thread of consumer *c*. Blocks until some
+ * shard has a message. Returns the number of bytes in the written message.
+ */
+size_t queue_sharded_get(queue_sharded_t *sq, unsigned int c, uint8_t **buffer, size_t size)
+{
+    size_t len;
+    uint32_t spin_limit = sq->shards[0].q.spin_limit;
+    int ret;
+
+    for (;;) {
+        if ((ret = queue_sharded_try_get(sq, c, buffer, size, &len)) == 1)
+            return len;
+
+        for (uint32_t i = 0; i < spin_limit && ret != 1; i++) {
+            queue_cpu_relax();
+            ret = queue_sharded_try_get(sq, c, buffer, size, &len);
+        }
+        if (ret == 1)
+            return len;
+
+        // A busy shard may hold more than its consumer takes, so don't sleep
+        // on it
+        if (ret == -1) {
+            sched_yield();
+            continue;
+        }
+
+        // Everything is empty, sleep until a producer puts something
+        __atomic_add_fetch(&sq->sleepers, 1, __ATOMIC_SEQ_CST);
+        uint32_t events = __atomic_load_n(&sq->events, __ATOMIC_ACQUIRE);
+        ret = queue_sharded_try_get(sq, c, buffer, size, &len);
+        if (ret == 0 && syscall(SYS_futex, &sq->events, FUTEX_WAIT_PRIVATE, events, NULL, NULL,
+                                0) == -1 && errno != EAGAIN && errno != EINTR)
+            queue_error_errno("Could not wait on futex");
+        __atomic_sub_fetch(&sq->sleepers, 1, __ATOMIC_RELAXED);
+        if (ret == 1)
+            return len;
+    }
+}
+
+#endif
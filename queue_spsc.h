@@ -0,0 +1,2114 @@
+#ifndef queue_spsc_h_
+#define queue_spsc_h_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "queue_layout.h"
+
+#define QUEUE_BOOT_ID_SIZE 40
+
+/* queue_stats sorts the sampled occupancy of the ring into this many equal
+ * slices of its size, and the producer takes a sample every
+ * QUEUE_STATS_SAMPLE commits (a power of two). The histogram lives in the
+ * control block, which has to fit into the one page header of shared and
+ * persistent queues, so there can be a few hundred buckets at most.
+ */
+#ifndef QUEUE_STATS_BUCKETS
+#define QUEUE_STATS_BUCKETS 16
+#endif
+#ifndef QUEUE_STATS_SAMPLE
+#define QUEUE_STATS_SAMPLE 64
+#endif
+
+/* With -DQUEUE_TIMESTAMPS the consumer sorts how long records sat in a
+ * QUEUE_FRAMED queue into a log-linear histogram: every power of two of
+ * nanoseconds is split into 2^QUEUE_LATENCY_PRECISION equal buckets, which
+ * keeps every value within 1 / 2^QUEUE_LATENCY_PRECISION of the truth, up
+ * to 2^QUEUE_LATENCY_RANGE ns (18 minutes)
+ */
+#ifndef QUEUE_LATENCY_PRECISION
+#define QUEUE_LATENCY_PRECISION 5
+#endif
+#ifndef QUEUE_LATENCY_RANGE
+#define QUEUE_LATENCY_RANGE 40
+#endif
+#define QUEUE_LATENCY_BUCKETS \
+    ((QUEUE_LATENCY_RANGE - QUEUE_LATENCY_PRECISION + 1) << QUEUE_LATENCY_PRECISION)
+
+/* Everything the producer and the consumer exchange. It normally lives inside
+ * queue_t; a QUEUE_SHARED queue keeps it in the first page of the memfd
+ * instead, so that another process mapping the memfd gets the same one.
+ */
+typedef struct {
+    // written once by queue_init_flags so that queue_attach can check and
+    // rebuild the queue: a magic number, the ring and header sizes, the page
+    // size and the QUEUE_* flags, then the pids of the two processes and, for
+    // a persistent queue, the boot the indices were last written in
+    uint64_t magic queue_cacheline_aligned;
+    size_t size;
+    size_t header_size;
+    size_t page_size;
+    unsigned int flags;
+    pid_t pids[2];
+    char boot_id[QUEUE_BOOT_ID_SIZE];
+
+    // set while queue_resize or queue_reclaim has the ring, both sides sleep
+    // on it
+    int resizing;
+
+    // producer-owned: write index, its offset into the buffer, the last read
+    // index the producer has seen, the consumer's waiting flag (1 while it
+    // sleeps, 2 while only its eventfd waits) and the tail it waits for
+    // (polled by the producer after every put, written by the consumer only
+    // when it goes to sleep), the current spin budget and how
+    // often the producer slept, then the last tail known to be on disk and
+    // whether the producer is between queue_reserve and queue_commit
+    size_t tail queue_cacheline_aligned;
+    size_t tail_off, cached_head;
+    int c_waiting;
+    size_t c_wait_for;
+    uint32_t p_spin;
+    uint32_t p_times;
+    size_t durable_tail;
+    int p_active;
+
+    // consumer-owned: the mirror image of the producer's group, except that
+    // the producer syncs the head of a persistent queue too when it needs the
+    // space: durable_head is the head written to disk, synced_head the one
+    // whose msync has returned
+    size_t head queue_cacheline_aligned;
+    size_t head_off, cached_tail;
+    int p_waiting;
+    size_t p_wait_for;
+    uint32_t c_spin;
+    uint32_t c_times;
+    size_t durable_head, synced_head;
+    int c_active;
+
+    // producer statistics, written only by the producer and read by
+    // queue_stats from anywhere: messages and bytes put, how often the
+    // producer had to wait for room and for how long in total, its commits
+    // (for sampling), the highest occupancy seen and the occupancy samples
+    uint64_t p_messages queue_cacheline_aligned;
+    uint64_t p_bytes;
+    uint64_t p_blocks;
+    uint64_t p_blocked_ns;
+    uint64_t p_commits;
+    size_t high_water;
+    uint64_t occupancy[QUEUE_STATS_BUCKETS];
+
+    // consumer statistics, the counterpart of the producer's
+    uint64_t c_messages queue_cacheline_aligned;
+    uint64_t c_bytes;
+    uint64_t c_blocks;
+    uint64_t c_blocked_ns;
+} queue_ctl_t;
+
+_Static_assert(sizeof(queue_ctl_t) <= 4096,
+               "queue_ctl_t must fit into one page, lower QUEUE_STATS_BUCKETS");
+
+typedef struct {
+    // read-only after queue_init: backing buffer, its size, the size of the
+    // pages backing it and its memfd
+    uint8_t *buffer queue_cacheline_aligned;
+    size_t size;
+    size_t page_size;
+    int fd;
+
+    // QUEUE_* flags the queue was created with, how long a side may spin
+    // before it goes to sleep on a futex and the futex private flag (cleared
+    // for QUEUE_SHARED queues)
+    unsigned int flags;
+    uint32_t spin_limit;
+    int futex_private;
+
+    // the control block, which side of a shared queue this process is (0 for
+    // the creator, 1 for the attacher), a pidfd of the process on the other
+    // side once a sleeper first checked on it, the eventfds of
+    // queue_writeable_fd and queue_readable_fd once asked for, and the
+    // control block itself when the queue is not shared
+    queue_ctl_t *ctl;
+    int side;
+    int peer_fd;
+    int p_efd, c_efd;
+    queue_ctl_t local;
+
+#ifdef QUEUE_TIMESTAMPS
+    // consumer-owned, read by queue_latency from any thread: the longest time
+    // a record sat in the ring and the histogram of those times
+    uint64_t latency_max queue_cacheline_aligned;
+    uint64_t latency[QUEUE_LATENCY_BUCKETS];
+#endif
+} queue_t;
+
+/* A snapshot of the counters of a queue, filled in by queue_stats */
+typedef struct {
+    // messages and bytes that went in and out; bytes are ring bytes, record
+    // headers and padding included, and queue_fill_from_fd, queue_drain_to_fd
+    // and a queue_peek / queue_release pair only count bytes
+    uint64_t messages_in, bytes_in;
+    uint64_t messages_out, bytes_out;
+
+    // how often each side had to wait, how often of those it went to sleep
+    // and the total time it spent waiting
+    uint64_t put_blocks, put_sleeps, put_blocked_ns;
+    uint64_t get_blocks, get_sleeps, get_blocked_ns;
+
+    // bytes in the ring right now, the most the producer has seen in it, and
+    // how many of its samples fell into each QUEUE_STATS_BUCKETS-th of the
+    // ring size
+    size_t occupancy, high_water;
+    uint64_t histogram[QUEUE_STATS_BUCKETS];
+} queue_stats_t;
+
+/* Sojourn times of the records of a queue in ns, filled in by queue_latency */
+typedef struct {
+    uint64_t count;
+    uint64_t p50, p99, p999, max;
+} queue_latency_t;
+
+#ifndef QUEUE_SPIN_LIMIT
+#define QUEUE_SPIN_LIMIT 4096
+#endif
+
+/* Flags for queue_init_flags */
+#define QUEUE_FRAMED 0x1     // every message carries its own length
+#define QUEUE_HUGETLB 0x2    // back the ring with 2 MB pages
+#define QUEUE_SHARED 0x4     // keep the control block in the memfd for queue_attach
+#define QUEUE_PERSISTENT 0x8 // set by queue_open: the ring lives in a regular file
+#define QUEUE_SYNC 0x10      // with queue_open: make every put and get durable
+#define QUEUE_RECLAIM 0x20   // give free pages back once the queue goes idle
+#define QUEUE_PREFAULT 0x40  // fault the whole ring in up front
+#define QUEUE_MLOCK 0x80     // fault the whole ring in and lock it in RAM
+
+#define QUEUE_HUGE_PAGE_SIZE (2UL << 20)
+
+/* Timestamped frames don't parse without timestamps and vice versa, so the
+ * two builds don't attach to or open each other's queues
+ */
+#ifdef QUEUE_TIMESTAMPS
+#define QUEUE_MAGIC 0x7370736351554554ULL
+#else
+#define QUEUE_MAGIC 0x7370736351554555ULL
+#endif
+
+/* A sleeper on a shared queue wakes up this often to check that the process
+ * on the other side is still alive
+ */
+#ifndef QUEUE_PEER_CHECK_NS
+#define QUEUE_PEER_CHECK_NS 100000000L
+#endif
+
+/* How long the consumer of a QUEUE_RECLAIM queue waits on an empty queue
+ * before it gives the free pages back
+ */
+#ifndef QUEUE_RECLAIM_IDLE_NS
+#define QUEUE_RECLAIM_IDLE_NS 100000000L
+#endif
+
+/* Older C libraries lack it, the kernel ignores it before 5.14 */
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/* Build with -DQUEUE_COPY_KERNELS to move messages with the copy kernels of
+ * queue_copy.h, non-temporal stores for big ones into the ring included,
+ * instead of memcpy
+ */
+#ifdef QUEUE_COPY_KERNELS
+#include "queue_copy.h"
+#define queue_copy_in queue_copy_stream
+#define queue_copy_out queue_copy
+#else
+#define queue_copy_in memcpy
+#define queue_copy_out memcpy
+#endif
+
+/* In a QUEUE_FRAMED queue every record starts with a size_t holding its
+ * length and is padded to a multiple of sizeof(size_t), so that the next
+ * header is aligned again. With -DQUEUE_TIMESTAMPS the length is followed by
+ * the CLOCK_MONOTONIC time the record was committed at.
+ */
+#ifdef QUEUE_TIMESTAMPS
+#define QUEUE_FRAME_HEADER (sizeof(size_t) + sizeof(uint64_t))
+#else
+#define QUEUE_FRAME_HEADER sizeof(size_t)
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <linux/memfd.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Convenience wrappers for erroring out */
+static inline void queue_error(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    abort();
+}
+static inline void queue_error_errno(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "queue error: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, " (errno %d)\n", errno);
+    va_end(args);
+    abort();
+}
+
+/* The statistics counters. Every one of them has a single writer, so a
+ * relaxed store of the new value does instead of an atomic add, and the
+ * producer only looks at the consumer's head once every QUEUE_STATS_SAMPLE
+ * commits. Build with -DQUEUE_NO_STATS to leave them at zero.
+ */
+static inline void queue_count(uint64_t *counter, uint64_t n)
+{
+#ifndef QUEUE_NO_STATS
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+#endif
+}
+
+/* CLOCK_MONOTONIC in ns, the same in every process */
+static inline uint64_t queue_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static inline uint64_t queue_stats_clock(void)
+{
+#ifndef QUEUE_NO_STATS
+    return queue_clock();
+#else
+    return 0;
+#endif
+}
+
+/* Count a wait of a side that started at *start* */
+static inline void queue_count_block(uint64_t *blocks, uint64_t *blocked_ns, uint64_t start)
+{
+    queue_count(blocks, 1);
+    queue_count(blocked_ns, queue_stats_clock() - start);
+}
+
+/* Producer: raise the high-water mark to *occupancy* */
+static inline void queue_count_high_water(queue_ctl_t *ctl, size_t occupancy)
+{
+#ifndef QUEUE_NO_STATS
+    if (occupancy > ctl->high_water)
+        __atomic_store_n(&ctl->high_water, occupancy, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Producer: after a commit up to *tail*, sample the occupancy every
+ * QUEUE_STATS_SAMPLE commits
+ */
+static inline void queue_count_sample(queue_t *q, size_t tail)
+{
+#ifndef QUEUE_NO_STATS
+    queue_count(&q->ctl->p_commits, 1);
+    if (q->ctl->p_commits & (QUEUE_STATS_SAMPLE - 1))
+        return;
+
+    size_t occupancy = tail - __atomic_load_n(&q->ctl->head, __ATOMIC_RELAXED);
+    size_t bucket = occupancy >= q->size ? QUEUE_STATS_BUCKETS - 1
+                                         : occupancy * QUEUE_STATS_BUCKETS / q->size;
+    queue_count(&q->ctl->occupancy[bucket], 1);
+    queue_count_high_water(q->ctl, occupancy);
+#endif
+}
+
+static void queue_stats_reset(queue_ctl_t *ctl)
+{
+    ctl->p_messages = ctl->p_bytes = ctl->p_blocks = ctl->p_blocked_ns = 0;
+    ctl->p_commits = ctl->high_water = 0;
+    memset(ctl->occupancy, 0, sizeof(ctl->occupancy));
+    ctl->c_messages = ctl->c_bytes = ctl->c_blocks = ctl->c_blocked_ns = 0;
+}
+
+/* The latency histogram bucket of *ns*: values below
+ * 2^QUEUE_LATENCY_PRECISION get one each, above that the top
+ * QUEUE_LATENCY_PRECISION + 1 bits pick the bucket
+ */
+static inline size_t queue_latency_bucket(uint64_t ns)
+{
+    if (ns < (1ULL << QUEUE_LATENCY_PRECISION))
+        return ns;
+    if (ns >= (1ULL << QUEUE_LATENCY_RANGE))
+        return QUEUE_LATENCY_BUCKETS - 1;
+
+    int shift = 63 - __builtin_clzll(ns) - QUEUE_LATENCY_PRECISION;
+    return ((size_t) (shift + 1) << QUEUE_LATENCY_PRECISION) +
+           (ns >> shift) - (1ULL << QUEUE_LATENCY_PRECISION);
+}
+
+/* The highest value that falls into latency histogram *bucket* */
+static inline uint64_t queue_latency_value(size_t bucket)
+{
+    size_t shift = bucket >> QUEUE_LATENCY_PRECISION;
+
+    if (shift == 0)
+        return bucket;
+    shift--;
+    return (((bucket & ((1ULL << QUEUE_LATENCY_PRECISION) - 1)) +
+             (1ULL << QUEUE_LATENCY_PRECISION) + 1) << shift) - 1;
+}
+
+/* Producer: stamp the record at *frame* with the time it is committed at */
+static inline void queue_frame_stamp(uint8_t *frame)
+{
+#ifdef QUEUE_TIMESTAMPS
+    *(uint64_t *) (frame + sizeof(size_t)) = queue_clock();
+#else
+    (void) frame;
+#endif
+}
+
+/* Consumer: count how long the record at *frame* sat in the ring, before it
+ * is released
+ */
+static inline void queue_count_latency(queue_t *q, const uint8_t *frame)
+{
+#ifdef QUEUE_TIMESTAMPS
+    int64_t ns = queue_clock() - *(const uint64_t *) (frame + sizeof(size_t));
+    size_t bucket = queue_latency_bucket(ns > 0 ? ns : 0);
+
+    if (ns > 0 && (uint64_t) ns > q->latency_max)
+        __atomic_store_n(&q->latency_max, ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->latency[bucket], q->latency[bucket] + 1, __ATOMIC_RELAXED);
+#else
+    (void) q;
+    (void) frame;
+#endif
+}
+
+static void queue_latency_reset(queue_t *q)
+{
+#ifdef QUEUE_TIMESTAMPS
+    q->latency_max = 0;
+    memset(q->latency, 0, sizeof(q->latency));
+#else
+    (void) q;
+#endif
+}
+
+static inline void queue_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Abort if the process on the other side of a shared queue has exited,
+ * rather than sleep forever on a ring nobody is going to touch again.
+ *
+ * A pidfd turns readable once the process is gone, zombie or not, which
+ * kill(pid, 0) can't tell; kernels without pidfd_open get the kill check.
+ */
+static void queue_check_peer(queue_t *q)
+{
+    pid_t peer = __atomic_load_n(&q->ctl->pids[!q->side], __ATOMIC_ACQUIRE);
+    struct pollfd pfd;
+
+    if (peer == 0)
+        return;
+
+    if (q->peer_fd == -1 && (q->peer_fd = syscall(SYS_pidfd_open, peer, 0)) == -1) {
+        if (errno == ESRCH || (kill(peer, 0) == -1 && errno == ESRCH))
+            queue_error("Process %d on the other side of the queue is gone", (int) peer);
+        return;
+    }
+
+    pfd.fd = q->peer_fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) == 1)
+        queue_error("Process %d on the other side of the queue is gone", (int) peer);
+}
+
+/* The waiting flags double as the futex words: a side that goes to sleep sets
+ * its flag to 1 and waits on it, the other side clears it and wakes it up.
+ */
+static inline int queue_futex_wait_ns(queue_t *q, int *waiting, long ns)
+{
+    struct timespec timeout = { ns / 1000000000L, ns % 1000000000L };
+
+    if (syscall(SYS_futex, waiting, FUTEX_WAIT | q->futex_private, 1,
+                ns ? &timeout : NULL, NULL, 0) == -1) {
+        if (errno == ETIMEDOUT)
+            return ETIMEDOUT;
+        if (errno != EAGAIN && errno != EINTR)
+            queue_error_errno("Could not wait on futex");
+    }
+    return 0;
+}
+
+/* Sleep on *waiting* until woken up or until the CLOCK_MONOTONIC *deadline*,
+ * NULL for none. Returns ETIMEDOUT once the deadline has passed, 0 otherwise.
+ */
+static inline int queue_futex_wait_until(queue_t *q, int *waiting,
+                                         const struct timespec *deadline)
+{
+    const struct timespec *until = deadline;
+    struct timespec check;
+    int checking = 0;
+
+    // Nobody can die on us in a private queue, so there is no need to time out
+    if (!q->futex_private) {
+        clock_gettime(CLOCK_MONOTONIC, &check);
+        check.tv_nsec += QUEUE_PEER_CHECK_NS;
+        check.tv_sec += check.tv_nsec / 1000000000L;
+        check.tv_nsec %= 1000000000L;
+        if (!deadline || check.tv_sec < deadline->tv_sec ||
+            (check.tv_sec == deadline->tv_sec && check.tv_nsec < deadline->tv_nsec)) {
+            until = &check;
+            checking = 1;
+        }
+    }
+
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC time, FUTEX_WAIT a
+    // relative one
+    if (syscall(SYS_futex, waiting, FUTEX_WAIT_BITSET | q->futex_private, 1, until, NULL,
+                FUTEX_BITSET_MATCH_ANY) == -1) {
+        if (errno == ETIMEDOUT && !checking)
+            return ETIMEDOUT;
+        if (errno == ETIMEDOUT)
+            queue_check_peer(q);
+        else if (errno != EAGAIN && errno != EINTR)
+            queue_error_errno("Could not wait on futex");
+    }
+    return 0;
+}
+
+/* Wake up the side whose flag *waiting* is, which has just been cleared: on
+ * the futex if it sleeps, through its eventfd if it has one
+ */
+static inline void queue_notify(queue_t *q, int *waiting)
+{
+    int efd = waiting == &q->ctl->c_waiting ? q->c_efd : q->p_efd;
+    uint64_t one = 1;
+
+    syscall(SYS_futex, waiting, FUTEX_WAKE | q->futex_private, 1, NULL, NULL, 0);
+    if (efd != -1 && write(efd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        queue_error_errno("Could not signal eventfd");
+}
+
+/* Wake the other side if it is asleep and *index* has reached the value it
+ * waits for.
+ *
+ * The fence orders our index store before the load of the waiting flag. The
+ * sleeping side does the opposite (flag store, fence, index load), so at
+ * least one of us sees the other's store and no wake-up is lost. Clearing the
+ * flag before the FUTEX_WAKE means a sleeper costs exactly one system call,
+ * not one per put or get until it gets to run again, and checking the target
+ * keeps a sleeper that needs a large message from being woken up for every
+ * small step of the other side.
+ */
+static inline void queue_wake(queue_t *q, int *waiting, size_t *wait_for, size_t index)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_ACQUIRE) &&
+        (ssize_t) (index - __atomic_load_n(wait_for, __ATOMIC_RELAXED)) >= 0 &&
+        __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED))
+        queue_notify(q, waiting);
+}
+
+/* Map *size* bytes of *fd* from *offset* on twice, back to back, at an address
+ * aligned to *align*.
+ *
+ * Returns the start of the first copy, or MAP_FAILED with nothing left mapped.
+ */
+static uint8_t *queue_map_mirror(int fd, size_t size, size_t align, off_t offset)
+{
+    uint8_t *area, *base;
+
+    // Ask mmap for a good address, with some slack to align it
+    if ((area = mmap(NULL, size * 2 + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                     -1, 0)) == MAP_FAILED)
+        return MAP_FAILED;
+
+    base = (uint8_t *) (((uintptr_t) area + align - 1) & ~(uintptr_t) (align - 1));
+    if (base != area)
+        munmap(area, base - area);
+    munmap(base + size * 2, area + align - base);
+
+    // Mmap first region, then the second one with exact address
+    if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED ||
+        mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+        munmap(base, size * 2);
+        return MAP_FAILED;
+    }
+
+    return base;
+}
+
+/* Fault in the *len* bytes of mirror at *area*, made of pages of *page_size*,
+ * for QUEUE_PREFAULT and lock them for QUEUE_MLOCK. Both halves of the
+ * mirror need it, each has its own page table entries. Returns -1 on
+ * failure.
+ */
+static int queue_populate(uint8_t *area, size_t len, size_t page_size, unsigned int flags)
+{
+    if (flags & QUEUE_MLOCK)
+        return mlock(area, len);
+
+    if (!(flags & QUEUE_PREFAULT) || madvise(area, len, MADV_POPULATE_WRITE) == 0)
+        return 0;
+
+    // Without MADV_POPULATE_WRITE, read every page; that allocates shmem
+    // pages and maps them writable, but can't touch what the other side
+    // may be writing
+    for (size_t off = 0; off < len; off += page_size)
+        (void) *(volatile uint8_t *) (area + off);
+    return 0;
+}
+
+/* Back *q* with an explicit 2 MB hugetlb memfd, behind a header of *header*
+ * bytes. Returns -1 if the system has none to give, in which case nothing is
+ * left allocated. The pages are allocated up front, since the pool may hold
+ * enough of them for the ring but not for the header as well.
+ */
+static int queue_init_hugetlb(queue_t *q, size_t size, size_t header)
+{
+    if ((q->fd = memfd_create("queue_region", MFD_HUGETLB | MFD_HUGE_2MB)) == -1)
+        return -1;
+
+    if (ftruncate(q->fd, header + size) != 0 || fallocate(q->fd, 0, 0, header + size) != 0 ||
+        (q->buffer = queue_map_mirror(q->fd, size, QUEUE_HUGE_PAGE_SIZE, header)) == MAP_FAILED) {
+        close(q->fd);
+        return -1;
+    }
+
+    q->page_size = QUEUE_HUGE_PAGE_SIZE;
+    return 0;
+}
+
+/* Back *q* with a memfd of regular pages, behind a header of *header* bytes.
+ * Returns -1 on failure, in which case nothing is left allocated.
+ */
+static int queue_init_memfd(queue_t *q, size_t size, size_t header, unsigned int flags)
+{
+    size_t align = flags & QUEUE_HUGETLB ? QUEUE_HUGE_PAGE_SIZE : (size_t) getpagesize();
+    int err;
+
+    // Create an anonymous file backed by memory
+    if ((q->fd = memfd_create("queue_region", 0)) == -1)
+        return -1;
+
+    // Set buffer size and map it twice
+    if (ftruncate(q->fd, header + size) != 0 ||
+        (q->buffer = queue_map_mirror(q->fd, size, align, header)) == MAP_FAILED) {
+        err = errno;
+        close(q->fd);
+        errno = err;
+        return -1;
+    }
+
+    // Fall back to transparent huge pages, if shmem has them
+    if (flags & QUEUE_HUGETLB)
+        madvise(q->buffer, size * 2, MADV_HUGEPAGE);
+
+    q->page_size = getpagesize();
+    return 0;
+}
+
+/* Point q->ctl at the control block: the first *header* bytes of the memfd
+ * for a shared queue, q->local otherwise
+ */
+static void queue_map_ctl(queue_t *q, size_t header)
+{
+    if (header == 0) {
+        q->ctl = &q->local;
+        return;
+    }
+
+    if ((q->ctl = mmap(NULL, header, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0)) == MAP_FAILED)
+        queue_error_errno("Could not map control block into virtual memory");
+}
+
+/** Initialize a lock-free single-producer / single-consumer queue *q* of
+ * size *s* with the QUEUE_* *flags*
+ *
+ * With QUEUE_HUGETLB the size is rounded to 2 MB and both halves of the
+ * mirror are 2 MB aligned. The ring comes from the hugetlb pool if it has
+ * enough free pages, otherwise from shmem with MADV_HUGEPAGE, which gets
+ * transparent huge pages where shmem_enabled allows them and plain pages
+ * elsewhere.
+ *
+ * With QUEUE_SHARED the control block goes into one extra page in front of
+ * the ring, and another process can attach to the queue with queue_attach or
+ * queue_attach_fd. With QUEUE_HUGETLB as well that page is padded to 2 MB,
+ * so that the ring starts on a huge page boundary of the memfd and the
+ * shmem fallback can still give it transparent huge pages.
+ *
+ * Left to itself the ring takes a page fault the first time each half of
+ * the mirror touches a page, which lands in the first lap after
+ * queue_init. QUEUE_PREFAULT takes them all here instead, and QUEUE_MLOCK
+ * also keeps the pages from being swapped out; it fails under a
+ * RLIMIT_MEMLOCK smaller than twice the ring. A process that attaches to
+ * the queue does the same for its own mapping.
+ */
+void queue_init_flags(queue_t *q, size_t s, unsigned int flags)
+{
+    /* Same double mapping as queue.h: the second half of the virtual region
+     * points to the same physical memory as the first one, so a message
+     * never has to be split at the end of the buffer.
+     */
+
+    if (flags & (QUEUE_PERSISTENT | QUEUE_SYNC))
+        queue_error("Persistent queues are created with queue_open");
+    if ((flags & QUEUE_RECLAIM) && (flags & QUEUE_SHARED))
+        queue_error("QUEUE_RECLAIM does not work with QUEUE_SHARED");
+    if ((flags & QUEUE_RECLAIM) && (flags & (QUEUE_PREFAULT | QUEUE_MLOCK)))
+        queue_error("QUEUE_RECLAIM does not work with QUEUE_PREFAULT or QUEUE_MLOCK");
+
+    size_t page_size = flags & QUEUE_HUGETLB ? QUEUE_HUGE_PAGE_SIZE : (size_t) getpagesize();
+    size_t real_mmap_size = ((s - 1 + page_size) / page_size) * page_size;
+    size_t header;
+
+    if (s % page_size != 0) {
+        fprintf(stderr,
+            "Requested size (%lu) is not a multiple of the page size (%lu),\n", s,
+            page_size);
+        fprintf(stderr, "Changing to %lu bytes.\n", real_mmap_size);
+    }
+
+    header = !(flags & QUEUE_SHARED) ? 0 : flags & QUEUE_HUGETLB ? QUEUE_HUGE_PAGE_SIZE
+                                                                 : (size_t) getpagesize();
+    if ((!(flags & QUEUE_HUGETLB) || queue_init_hugetlb(q, real_mmap_size, header) != 0) &&
+        queue_init_memfd(q, real_mmap_size, header, flags) != 0)
+        queue_error_errno("Could not map buffer into virtual memory");
+
+    queue_map_ctl(q, header);
+
+    if (queue_populate(q->buffer, real_mmap_size * 2, q->page_size, flags) != 0)
+        queue_error_errno("Could not fault in or lock buffer");
+
+    // Spinning only pays off when the other side runs on another cpu
+    q->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPIN_LIMIT : 0;
+
+    // Initialize remaining members
+    q->size = real_mmap_size;
+    q->flags = flags;
+    q->futex_private = flags & QUEUE_SHARED ? 0 : FUTEX_PRIVATE_FLAG;
+    q->side = 0;
+    q->peer_fd = -1;
+    q->p_efd = q->c_efd = -1;
+    queue_latency_reset(q);
+    q->ctl->tail = q->ctl->tail_off = q->ctl->cached_head = 0;
+    q->ctl->head = q->ctl->head_off = q->ctl->cached_tail = 0;
+    q->ctl->p_waiting = q->ctl->c_waiting = 0;
+    q->ctl->p_wait_for = q->ctl->c_wait_for = 0;
+    q->ctl->p_spin = q->ctl->c_spin = q->spin_limit;
+    q->ctl->p_times = q->ctl->c_times = 0;
+    q->ctl->p_active = q->ctl->c_active = q->ctl->resizing = 0;
+    queue_stats_reset(q->ctl);
+
+    // Describe the queue for queue_attach, magic number last
+    q->ctl->size = real_mmap_size;
+    q->ctl->header_size = header;
+    q->ctl->page_size = q->page_size;
+    q->ctl->flags = flags;
+    q->ctl->pids[0] = getpid();
+    q->ctl->pids[1] = 0;
+    __atomic_store_n(&q->ctl->magic, QUEUE_MAGIC, __ATOMIC_RELEASE);
+}
+
+/** Initialize a lock-free single-producer / single-consumer queue *q* of
+ * size *s*
+ */
+void queue_init(queue_t *q, size_t s)
+{
+    queue_init_flags(q, s, 0);
+}
+
+/** Attach *q* to the QUEUE_SHARED queue another process created on the memfd
+ * *fd*, e.g. one inherited across fork / exec. *q* takes over *fd*.
+ *
+ * The creator of the queue is one side of it and the attaching process the
+ * other; which of them produces is up to the two of them.
+ */
+void queue_attach(queue_t *q, int fd)
+{
+    struct stat st;
+    queue_ctl_t *ctl;
+    size_t probe, header;
+
+    // The header is at least one page of the memfd's own page size
+    if (fstat(fd, &st) != 0)
+        queue_error_errno("Could not stat queue file descriptor");
+    probe = (size_t) st.st_blksize > (size_t) getpagesize() ? (size_t) st.st_blksize
+                                                             : (size_t) getpagesize();
+    if ((size_t) st.st_size < probe)
+        queue_error("File descriptor %d does not hold a shared queue", fd);
+
+    if ((ctl = mmap(NULL, probe, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+        queue_error_errno("Could not map control block into virtual memory");
+    if (__atomic_load_n(&ctl->magic, __ATOMIC_ACQUIRE) != QUEUE_MAGIC ||
+        !(ctl->flags & QUEUE_SHARED))
+        queue_error("File descriptor %d does not hold a shared queue", fd);
+
+    q->fd = fd;
+    q->size = ctl->size;
+    q->page_size = ctl->page_size;
+    q->flags = ctl->flags;
+    header = ctl->header_size;
+    munmap(ctl, probe);
+
+    queue_map_ctl(q, header);
+    if ((q->buffer = queue_map_mirror(fd, q->size, q->flags & QUEUE_HUGETLB ? QUEUE_HUGE_PAGE_SIZE
+                                                                            : q->page_size,
+                                      header)) == MAP_FAILED)
+        queue_error_errno("Could not map buffer into virtual memory");
+    if (queue_populate(q->buffer, q->size * 2, q->page_size, q->flags) != 0)
+        queue_error_errno("Could not fault in or lock buffer");
+
+    q->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPIN_LIMIT : 0;
+    q->futex_private = 0;
+    q->side = 1;
+    q->peer_fd = -1;
+    q->p_efd = q->c_efd = -1;
+    queue_latency_reset(q);
+    __atomic_store_n(&q->ctl->pids[1], getpid(), __ATOMIC_RELEASE);
+}
+
+/** Send the memfd of the QUEUE_SHARED queue *q* over the UNIX socket *sock*,
+ * for the process on the other end to attach to with queue_attach_fd
+ */
+void queue_export_fd(queue_t *q, int sock)
+{
+    char byte = 0;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+
+    if (!(q->flags & QUEUE_SHARED))
+        queue_error("Only a QUEUE_SHARED queue can be exported");
+
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &q->fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != 1)
+        queue_error_errno("Could not send queue file descriptor");
+}
+
+/** Receive a queue memfd sent with queue_export_fd from the UNIX socket
+ * *sock* and attach *q* to it
+ */
+void queue_attach_fd(queue_t *q, int sock)
+{
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cmsg;
+    int fd;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+        queue_error_errno("Could not receive queue file descriptor");
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+        queue_error("No file descriptor received on socket %d", sock);
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    queue_attach(q, fd);
+}
+
+/* Read the id of the current boot into *id*, or leave it empty if the system
+ * doesn't say
+ */
+static void queue_boot_id(char *id)
+{
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    memset(id, 0, QUEUE_BOOT_ID_SIZE);
+    if (f == NULL)
+        return;
+    if (fgets(id, QUEUE_BOOT_ID_SIZE, f) == NULL)
+        id[0] = '\0';
+    fclose(f);
+}
+
+/* Write the file pages behind ring bytes [from, to) back to disk */
+static void queue_msync_ring(queue_t *q, size_t from, size_t to)
+{
+    uint8_t *start;
+    size_t len;
+
+    // Thanks to the mirror any q->size bytes are contiguous
+    if (to - from > q->size)
+        from = to - q->size;
+    start = q->buffer + from % q->size;
+    len = to - from + ((uintptr_t) start & (q->page_size - 1));
+    start -= (uintptr_t) start & (q->page_size - 1);
+
+    if (len != 0 && msync(start, len, MS_SYNC) != 0)
+        queue_error_errno("Could not write buffer back to disk");
+}
+
+static inline void queue_msync_ctl(queue_t *q)
+{
+    if (msync(q->ctl, q->ctl->header_size, MS_SYNC) != 0)
+        queue_error_errno("Could not write control block back to disk");
+}
+
+/* Producer side of queue_sync_tail: make the bytes up to *tail* durable */
+static void queue_sync_tail_to(queue_t *q, size_t tail)
+{
+    if (tail == q->ctl->durable_tail)
+        return;
+
+    // Data first, so the durable tail never points past what is on disk
+    queue_msync_ring(q, q->ctl->durable_tail, tail);
+    __atomic_store_n(&q->ctl->durable_tail, tail, __ATOMIC_RELAXED);
+    queue_msync_ctl(q);
+}
+
+/** Make everything put into the persistent queue *q* so far survive a crash
+ * of the system. Must be called by the producer.
+ *
+ * Without QUEUE_SYNC this is how the producer batches its msyncs.
+ */
+void queue_sync_tail(queue_t *q)
+{
+    queue_sync_tail_to(q, q->ctl->tail);
+}
+
+/* Raise *index* to *value* unless the other side already raised it further */
+static inline void queue_raise(size_t *index, size_t value)
+{
+    size_t old = __atomic_load_n(index, __ATOMIC_RELAXED);
+    while ((ssize_t) (value - old) > 0 &&
+           !__atomic_compare_exchange_n(index, &old, value, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+        ;
+}
+
+/** Make everything taken out of the persistent queue *q* so far stay taken
+ * out after a crash of the system. May be called by either side.
+ */
+void queue_sync_head(queue_t *q)
+{
+    size_t head = __atomic_load_n(&q->ctl->head, __ATOMIC_ACQUIRE);
+
+    if (head == __atomic_load_n(&q->ctl->synced_head, __ATOMIC_ACQUIRE))
+        return;
+
+    queue_raise(&q->ctl->durable_head, head);
+    queue_msync_ctl(q);
+    queue_raise(&q->ctl->synced_head, head);
+
+    queue_wake(q, &q->ctl->p_waiting, &q->ctl->p_wait_for, head);
+}
+
+/** Open the persistent queue in the file *path*, with the QUEUE_* *flags*,
+ * creating it with a ring of size *s* if the file is empty or doesn't exist
+ *
+ * The file is double mapped just like the memfd of queue_init, behind a
+ * header page that holds the control block, and whatever was put but not yet
+ * taken out when the queue was last used is still in it. A crash of the
+ * process loses nothing: the page cache still has every committed message
+ * and index. A crash of the system falls back to the last tail and head
+ * written back with queue_sync_tail and queue_sync_head, or on every put and
+ * get with QUEUE_SYNC, so messages are delivered at least once.
+ *
+ * The queue is QUEUE_SHARED, so a second process may attach to it, but only
+ * one process can have it open with queue_open at a time. The size and
+ * QUEUE_FRAMED of an existing file win over *s* and *flags*; QUEUE_SYNC may
+ * change from one open to the next.
+ */
+void queue_open(queue_t *q, const char *path, size_t s, unsigned int flags)
+{
+    size_t page_size = getpagesize();
+    size_t real_mmap_size = ((s - 1 + page_size) / page_size) * page_size;
+    size_t header = page_size;
+    char boot_id[QUEUE_BOOT_ID_SIZE];
+    struct stat st;
+    int created;
+
+    if (flags & (QUEUE_HUGETLB | QUEUE_RECLAIM))
+        queue_error("A persistent queue can't use QUEUE_HUGETLB or QUEUE_RECLAIM");
+
+    if ((q->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+        queue_error_errno("Could not open %s", path);
+
+    if (flock(q->fd, LOCK_EX | LOCK_NB) != 0)
+        queue_error_errno("%s is already open", path);
+
+    if (fstat(q->fd, &st) != 0)
+        queue_error_errno("Could not stat %s", path);
+
+    created = st.st_size == 0;
+    if (created && ftruncate(q->fd, header + real_mmap_size) != 0)
+        queue_error_errno("Could not set size of %s", path);
+    if (!created && (size_t) st.st_size < header + page_size)
+        queue_error("%s does not hold a queue", path);
+
+    queue_map_ctl(q, header);
+
+    if (!created) {
+        if (q->ctl->magic != QUEUE_MAGIC || !(q->ctl->flags & QUEUE_PERSISTENT) ||
+            q->ctl->header_size != header || q->ctl->size + header != (size_t) st.st_size)
+            queue_error("%s does not hold a queue", path);
+        real_mmap_size = q->ctl->size;
+        flags = (q->ctl->flags & ~QUEUE_SYNC) | (flags & QUEUE_SYNC);
+    }
+
+    if ((q->buffer = queue_map_mirror(q->fd, real_mmap_size, page_size, header)) == MAP_FAILED)
+        queue_error_errno("Could not map buffer into virtual memory");
+    if (queue_populate(q->buffer, real_mmap_size * 2, page_size, flags) != 0)
+        queue_error_errno("Could not fault in or lock buffer");
+
+    q->size = real_mmap_size;
+    q->page_size = page_size;
+    q->flags = flags | QUEUE_SHARED | QUEUE_PERSISTENT;
+    q->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_SPIN_LIMIT : 0;
+    q->futex_private = 0;
+    q->side = 0;
+    q->peer_fd = -1;
+    q->p_efd = q->c_efd = -1;
+    queue_latency_reset(q);
+
+    queue_boot_id(boot_id);
+
+    if (created) {
+        q->ctl->tail = q->ctl->head = 0;
+        q->ctl->durable_tail = q->ctl->durable_head = 0;
+    } else if (boot_id[0] == '\0' || strcmp(boot_id, q->ctl->boot_id) != 0) {
+        // The system went down since, only what was synced is on disk
+        q->ctl->tail = q->ctl->durable_tail;
+        q->ctl->head = q->ctl->durable_head;
+    }
+
+    // A head ahead of the tail means the data it was read from didn't make it
+    if ((ssize_t) (q->ctl->head - q->ctl->tail) > 0)
+        q->ctl->head = q->ctl->durable_head = q->ctl->tail;
+
+    q->ctl->synced_head = q->ctl->durable_head;
+    q->ctl->tail_off = q->ctl->tail % q->size;
+    q->ctl->head_off = q->ctl->head % q->size;
+    q->ctl->cached_head = q->ctl->synced_head;
+    q->ctl->cached_tail = q->ctl->tail;
+    q->ctl->p_waiting = q->ctl->c_waiting = 0;
+    q->ctl->p_wait_for = q->ctl->c_wait_for = 0;
+    q->ctl->p_spin = q->ctl->c_spin = q->spin_limit;
+    q->ctl->p_times = q->ctl->c_times = 0;
+    q->ctl->p_active = q->ctl->c_active = q->ctl->resizing = 0;
+    queue_stats_reset(q->ctl);
+
+    q->ctl->size = real_mmap_size;
+    q->ctl->header_size = header;
+    q->ctl->page_size = page_size;
+    q->ctl->flags = q->flags;
+    q->ctl->pids[0] = getpid();
+    q->ctl->pids[1] = 0;
+    memcpy(q->ctl->boot_id, boot_id, QUEUE_BOOT_ID_SIZE);
+    __atomic_store_n(&q->ctl->magic, QUEUE_MAGIC, __ATOMIC_RELEASE);
+
+    queue_msync_ctl(q);
+}
+
+/** Destroy the queue *q*
+ *
+ * For a shared queue this only drops this process's mappings; the memory goes
+ * away with the last process that has the memfd open. A persistent queue that
+ * nobody attached to is synced to disk first; with two processes on it each
+ * side syncs its own index.
+ */
+void queue_destroy(queue_t *q)
+{
+    if ((q->flags & QUEUE_PERSISTENT) && q->ctl->pids[1] == 0) {
+        queue_sync_tail(q);
+        queue_sync_head(q);
+    }
+
+    if (munmap(q->buffer + q->size, q->size) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (munmap(q->buffer, q->size) != 0)
+        queue_error_errno("Could not unmap buffer");
+
+    if (q->ctl != &q->local && munmap(q->ctl, q->ctl->header_size) != 0)
+        queue_error_errno("Could not unmap control block");
+
+    if (q->peer_fd != -1)
+        close(q->peer_fd);
+    if (q->p_efd != -1)
+        close(q->p_efd);
+    if (q->c_efd != -1)
+        close(q->c_efd);
+
+    if (close(q->fd) != 0)
+        queue_error_errno("Could not close anonymous file");
+}
+
+/* Clear the waiting flag of a sleeping side, so that it wakes up and looks at
+ * the ring again
+ */
+static inline void queue_kick(queue_t *q, int *waiting)
+{
+    if (__atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED))
+        queue_notify(q, waiting);
+}
+
+/* Take the ring away from both sides of *q*: they finish what they are doing
+ * on it and wait in queue_enter until queue_unquiesce. Returns 0, EBUSY if
+ * somebody else has the ring already, or errno if membarrier fails.
+ */
+static int queue_quiesce(queue_t *q)
+{
+    if (__atomic_exchange_n(&q->ctl->resizing, 1, __ATOMIC_ACQUIRE))
+        return EBUSY;
+
+    // The full fence for both sides' queue_enter, then wait for them to leave
+    if (syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) != 0 ||
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) != 0) {
+        int err = errno;
+        __atomic_store_n(&q->ctl->resizing, 0, __ATOMIC_RELEASE);
+        return err;
+    }
+    while (__atomic_load_n(&q->ctl->p_active, __ATOMIC_ACQUIRE) ||
+           __atomic_load_n(&q->ctl->c_active, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    return 0;
+}
+
+static void queue_unquiesce(queue_t *q)
+{
+    __atomic_store_n(&q->ctl->resizing, 0, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &q->ctl->resizing, FUTEX_WAKE | q->futex_private, INT_MAX, NULL, NULL, 0);
+}
+
+/** Give queue *q* a new ring of *s* bytes, rounded like in queue_init, while
+ * the producer and the consumer keep using the queue
+ *
+ * The pending bytes move to a new memfd with its own double mapping, which
+ * replaces the old one. Both sides stay off the ring for the time it takes
+ * to copy them, but may be anywhere else, asleep included; views from
+ * queue_reserve and queue_peek stay valid until queue_commit and
+ * queue_release, and the resize waits for them. May be called from any
+ * thread, including the producer and the consumer between their calls.
+ *
+ * Returns 0 on success; EBUSY if another resize is in progress, or the new
+ * ring would not hold the pending bytes, the largest message, or the
+ * queue_putv / queue_getv batch a side is waiting for; EINVAL for shared and
+ * persistent queues, whose ring other processes map too; and the errno of the
+ * failed system call otherwise. The queue is left as it was on failure.
+ */
+int queue_resize(queue_t *q, size_t s)
+{
+    size_t page_size = q->flags & QUEUE_HUGETLB ? QUEUE_HUGE_PAGE_SIZE : (size_t) getpagesize();
+    size_t real_mmap_size = ((s - 1 + page_size) / page_size) * page_size;
+    size_t pending;
+    queue_t n;
+    int err;
+
+    if (q->flags & QUEUE_SHARED)
+        return EINVAL;
+
+    if ((err = queue_quiesce(q)) != 0)
+        return err;
+
+    // Everything pending and whatever a sleeping side waits for must fit. A
+    // side that only armed its eventfd is not held to it: it retries from
+    // queue_try_put or queue_try_get once the kick below signals it.
+    pending = q->ctl->tail - q->ctl->head;
+    if (pending > real_mmap_size ||
+        (q->ctl->p_waiting == 1 &&
+         q->ctl->p_wait_for + q->size - q->ctl->tail > real_mmap_size) ||
+        (q->ctl->c_waiting == 1 && q->ctl->c_wait_for - q->ctl->head > real_mmap_size)) {
+        err = EBUSY;
+        goto out;
+    }
+
+    if ((!(q->flags & QUEUE_HUGETLB) || queue_init_hugetlb(&n, real_mmap_size, 0) != 0) &&
+        queue_init_memfd(&n, real_mmap_size, 0, q->flags) != 0) {
+        err = errno;
+        goto out;
+    }
+    if (queue_populate(n.buffer, real_mmap_size * 2, n.page_size, q->flags) != 0) {
+        err = errno;
+        munmap(n.buffer, real_mmap_size * 2);
+        close(n.fd);
+        goto out;
+    }
+
+    // The mirror makes the pending bytes contiguous in the old ring, and
+    // they go to the start of the new one
+    memcpy(n.buffer, q->buffer + q->ctl->head_off, pending);
+
+    munmap(q->buffer, q->size * 2);
+    close(q->fd);
+
+    q->buffer = n.buffer;
+    q->fd = n.fd;
+    q->size = real_mmap_size;
+    q->page_size = n.page_size;
+    q->ctl->size = real_mmap_size;
+    q->ctl->page_size = n.page_size;
+    q->ctl->head_off = 0;
+    q->ctl->tail_off = pending == real_mmap_size ? 0 : pending;
+    q->ctl->cached_head = q->ctl->head;
+    q->ctl->cached_tail = q->ctl->tail;
+
+out:
+    queue_unquiesce(q);
+
+    // Sleepers wait for targets computed with the old size
+    if (err == 0) {
+        queue_kick(q, &q->ctl->p_waiting);
+        queue_kick(q, &q->ctl->c_waiting);
+    }
+
+    return err;
+}
+
+/** Give the pages of queue *q* that hold no pending bytes back to the system
+ *
+ * The ring is only ever backed by the pages the producer touched, which
+ * without this stay allocated up to the highest occupancy the queue ever
+ * had. Released pages come back zeroed, one page fault each, when the
+ * producer reaches them again. Like queue_resize this may be called from
+ * any thread while both sides use the queue. A QUEUE_RECLAIM queue calls it
+ * by itself once the consumer has waited QUEUE_RECLAIM_IDLE_NS on an empty
+ * queue.
+ *
+ * Returns the number of bytes released, always 0 for shared queues and for
+ * QUEUE_PREFAULT and QUEUE_MLOCK ones, which asked to keep their pages.
+ */
+size_t queue_reclaim(queue_t *q)
+{
+    size_t start, end, off, len, first;
+
+    if ((q->flags & (QUEUE_SHARED | QUEUE_PREFAULT | QUEUE_MLOCK)) || queue_quiesce(q) != 0)
+        return 0;
+
+    // Whole pages between the tail and the head of the next lap are free
+    start = (q->ctl->tail + q->page_size - 1) & ~(q->page_size - 1);
+    end = (q->ctl->head + q->size) & ~(q->page_size - 1);
+    len = end > start ? end - start : 0;
+
+    if (len) {
+        off = start % q->size;
+        first = len < q->size - off ? len : q->size - off;
+        if (fallocate(q->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, first) != 0 ||
+            (len > first &&
+             fallocate(q->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, len - first) != 0))
+            queue_error_errno("Could not release free pages");
+    }
+
+    queue_unquiesce(q);
+    return len;
+}
+
+/* Each side marks the time it works on the ring, from queue_reserve to
+ * queue_commit and from queue_peek to queue_release, with its active flag,
+ * and stays off the ring while queue_resize swaps it.
+ *
+ * This is Dekker's handshake, but the full fence it needs between the store
+ * of the active flag and the load of the resizing flag is issued by
+ * queue_resize for both sides with membarrier, so the fast path gets away
+ * with a compiler barrier.
+ */
+static inline void queue_enter(queue_t *q, int *active)
+{
+    for (;;) {
+        __atomic_store_n(active, 1, __ATOMIC_RELAXED);
+        __atomic_signal_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&q->ctl->resizing, __ATOMIC_ACQUIRE))
+            return;
+
+        __atomic_store_n(active, 0, __ATOMIC_RELEASE);
+        if (syscall(SYS_futex, &q->ctl->resizing, FUTEX_WAIT | q->futex_private, 1,
+                    NULL, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR)
+            queue_error_errno("Could not wait on futex");
+    }
+}
+
+static inline void queue_leave(int *active)
+{
+    __atomic_store_n(active, 0, __ATOMIC_RELEASE);
+}
+
+/* Spin budgets adapt to how the last wait went: a wait that was satisfied
+ * while spinning allows a longer spin next time, one that ended up asleep
+ * halves it.
+ */
+static inline uint32_t queue_spin_adapt(queue_t *q, uint32_t spin, int slept)
+{
+    if (slept)
+        return spin / 2;
+    spin = spin ? spin * 2 : 1;
+    return spin < q->spin_limit ? spin : q->spin_limit;
+}
+
+/* The head the producer may reuse space up to. In a persistent queue that is
+ * the synced head, or a crash of the system could leave the ring with
+ * messages from after the synced tail where the recovered head expects the
+ * old ones, so the producer syncs the head itself whenever it looks for space.
+ */
+static inline size_t queue_load_head(queue_t *q)
+{
+    if (!(q->flags & QUEUE_PERSISTENT))
+        return __atomic_load_n(&q->ctl->head, __ATOMIC_ACQUIRE);
+
+    queue_sync_head(q);
+    return __atomic_load_n(&q->ctl->synced_head, __ATOMIC_ACQUIRE);
+}
+
+/* Producer slow path: wait until *size* bytes are free after *tail*, or until
+ * the CLOCK_MONOTONIC *deadline* (NULL for none). Returns 0, or ETIMEDOUT if
+ * the deadline passed first.
+ */
+static int queue_wait_writeable(queue_t *q, size_t tail, size_t size,
+                                const struct timespec *deadline)
+{
+    uint64_t start = queue_stats_clock();
+
+    // Poll the plain head and sync it only once it shows the space, so that a
+    // persistent queue doesn't msync on every round
+    for (uint32_t i = 0; i < q->ctl->p_spin; i++) {
+        queue_cpu_relax();
+        if (q->size - (tail - __atomic_load_n(&q->ctl->head, __ATOMIC_ACQUIRE)) < size)
+            continue;
+        q->ctl->cached_head = queue_load_head(q);
+        if (q->size - (tail - q->ctl->cached_head) >= size) {
+            q->ctl->p_spin = queue_spin_adapt(q, q->ctl->p_spin, 0);
+            queue_count_block(&q->ctl->p_blocks, &q->ctl->p_blocked_ns, start);
+            return 0;
+        }
+    }
+
+    // Sleep off the ring, queue_resize may change its size in the meantime
+    for (;;) {
+        __atomic_store_n(&q->ctl->p_wait_for, tail + size - q->size, __ATOMIC_RELAXED);
+        __atomic_store_n(&q->ctl->p_waiting, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        q->ctl->cached_head = queue_load_head(q);
+        if (q->size - (tail - q->ctl->cached_head) >= size)
+            break;
+        queue_count_high_water(q->ctl, tail - q->ctl->cached_head);
+        q->ctl->p_times++;
+        queue_leave(&q->ctl->p_active);
+        if (queue_futex_wait_until(q, &q->ctl->p_waiting, deadline) == ETIMEDOUT) {
+            __atomic_store_n(&q->ctl->p_waiting, 0, __ATOMIC_RELAXED);
+            queue_enter(q, &q->ctl->p_active);
+            queue_count_block(&q->ctl->p_blocks, &q->ctl->p_blocked_ns, start);
+            return ETIMEDOUT;
+        }
+        queue_enter(q, &q->ctl->p_active);
+    }
+    __atomic_store_n(&q->ctl->p_waiting, 0, __ATOMIC_RELAXED);
+    q->ctl->p_spin = queue_spin_adapt(q, q->ctl->p_spin, 1);
+    queue_count_block(&q->ctl->p_blocks, &q->ctl->p_blocked_ns, start);
+    return 0;
+}
+
+/* Consumer slow path: wait until *size* bytes are pending after *head*, or
+ * until the CLOCK_MONOTONIC *deadline* (NULL for none). Returns 0, or
+ * ETIMEDOUT if the deadline passed first.
+ */
+static int queue_wait_readable(queue_t *q, size_t head, size_t size,
+                               const struct timespec *deadline)
+{
+    uint64_t start = queue_stats_clock();
+
+    for (uint32_t i = 0; i < q->ctl->c_spin; i++) {
+        queue_cpu_relax();
+        q->ctl->cached_tail = __atomic_load_n(&q->ctl->tail, __ATOMIC_ACQUIRE);
+        if (q->ctl->cached_tail - head >= size) {
+            q->ctl->c_spin = queue_spin_adapt(q, q->ctl->c_spin, 0);
+            queue_count_block(&q->ctl->c_blocks, &q->ctl->c_blocked_ns, start);
+            return 0;
+        }
+    }
+
+    __atomic_store_n(&q->ctl->c_wait_for, head + size, __ATOMIC_RELAXED);
+    // The first sleep on a QUEUE_RECLAIM queue times out to release its pages,
+    // unless the caller has a deadline of its own
+    for (int idle = !deadline && (q->flags & QUEUE_RECLAIM);;) {
+        __atomic_store_n(&q->ctl->c_waiting, 1, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        q->ctl->cached_tail = __atomic_load_n(&q->ctl->tail, __ATOMIC_ACQUIRE);
+        if (q->ctl->cached_tail - head >= size)
+            break;
+        q->ctl->c_times++;
+        queue_leave(&q->ctl->c_active);
+        if (idle && queue_futex_wait_ns(q, &q->ctl->c_waiting, QUEUE_RECLAIM_IDLE_NS) == ETIMEDOUT)
+            queue_reclaim(q);
+        else if (!idle &&
+                 queue_futex_wait_until(q, &q->ctl->c_waiting, deadline) == ETIMEDOUT) {
+            __atomic_store_n(&q->ctl->c_waiting, 0, __ATOMIC_RELAXED);
+            queue_enter(q, &q->ctl->c_active);
+            queue_count_block(&q->ctl->c_blocks, &q->ctl->c_blocked_ns, start);
+            return ETIMEDOUT;
+        }
+        idle = 0;
+        queue_enter(q, &q->ctl->c_active);
+    }
+    __atomic_store_n(&q->ctl->c_waiting, 0, __ATOMIC_RELAXED);
+    q->ctl->c_spin = queue_spin_adapt(q, q->ctl->c_spin, 1);
+    queue_count_block(&q->ctl->c_blocks, &q->ctl->c_blocked_ns, start);
+    return 0;
+}
+
+/* Producer side of a failed queue_try_put: with an eventfd from
+ * queue_writeable_fd, set the waiting flag to 2, so that the consumer signals
+ * the eventfd once *size* bytes are free after *tail* while queue_resize
+ * knows that nobody sleeps. Returns 0 if they turned free in the meantime,
+ * EAGAIN otherwise.
+ */
+static int queue_arm_writeable(queue_t *q, size_t tail, size_t size)
+{
+    if (q->p_efd == -1)
+        return EAGAIN;
+
+    __atomic_store_n(&q->ctl->p_wait_for, tail + size - q->size, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->ctl->p_waiting, 2, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    q->ctl->cached_head = queue_load_head(q);
+    if (q->size - (tail - q->ctl->cached_head) < size)
+        return EAGAIN;
+
+    __atomic_store_n(&q->ctl->p_waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Consumer side of a failed queue_try_get, the mirror image of
+ * queue_arm_writeable
+ */
+static int queue_arm_readable(queue_t *q, size_t head, size_t size)
+{
+    if (q->c_efd == -1)
+        return EAGAIN;
+
+    __atomic_store_n(&q->ctl->c_wait_for, head + size, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->ctl->c_waiting, 2, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    q->ctl->cached_tail = __atomic_load_n(&q->ctl->tail, __ATOMIC_ACQUIRE);
+    if (q->ctl->cached_tail - head < size)
+        return EAGAIN;
+
+    __atomic_store_n(&q->ctl->c_waiting, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline size_t queue_frame_size(size_t len)
+{
+    return (QUEUE_FRAME_HEADER + len + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+static inline size_t queue_frame_len(const uint8_t *frame)
+{
+    return *(const size_t *) frame;
+}
+
+/* queue_reserve_bytes_until for a producer that has already entered the ring,
+ * and so sees the size queue_resize leaves it with
+ */
+static inline int queue_reserve_entered(queue_t *q, size_t size,
+                                        const struct timespec *deadline, int wait)
+{
+    size_t tail = q->ctl->tail;
+    int err;
+
+    if (size > q->size)
+        queue_error("Message size (%lu) exceeds queue size (%lu)", size, q->size);
+
+    // Only look at the consumer's index when our cached copy says we're full
+    if (q->size - (tail - q->ctl->cached_head) < size) {
+        q->ctl->cached_head = queue_load_head(q);
+        if (q->size - (tail - q->ctl->cached_head) < size &&
+            (err = wait ? queue_wait_writeable(q, tail, size, deadline)
+                        : queue_arm_writeable(q, tail, size)) != 0) {
+            queue_leave(&q->ctl->p_active);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/* Reserve *size* raw bytes at &q->buffer[q->ctl->tail_off]. Without *wait*
+ * this returns EAGAIN at once if they are not free, otherwise it waits for
+ * them until the CLOCK_MONOTONIC *deadline* (NULL for none) and returns
+ * ETIMEDOUT when that passes. Returns 0 once the bytes are reserved.
+ */
+static inline int queue_reserve_bytes_until(queue_t *q, size_t size,
+                                            const struct timespec *deadline, int wait)
+{
+    queue_enter(q, &q->ctl->p_active);
+    return queue_reserve_entered(q, size, deadline, wait);
+}
+
+/* Reserve *size* raw bytes, blocking until they are free */
+static inline uint8_t *queue_reserve_bytes(queue_t *q, size_t size)
+{
+    queue_reserve_bytes_until(q, size, NULL, 1);
+    return &q->buffer[q->ctl->tail_off];
+}
+
+/* Publish *size* raw bytes */
+static inline void queue_commit_bytes(queue_t *q, size_t size)
+{
+    q->ctl->tail_off += size;
+    if (q->ctl->tail_off >= q->size)
+        q->ctl->tail_off -= q->size;
+
+    // Only ever hand out messages that are on disk
+    if (q->flags & QUEUE_SYNC)
+        queue_sync_tail_to(q, q->ctl->tail + size);
+
+    // Publish the message
+    __atomic_store_n(&q->ctl->tail, q->ctl->tail + size, __ATOMIC_RELEASE);
+    queue_leave(&q->ctl->p_active);
+
+    queue_count(&q->ctl->p_bytes, size);
+    queue_count_sample(q, q->ctl->tail);
+
+    queue_wake(q, &q->ctl->c_waiting, &q->ctl->c_wait_for, q->ctl->tail);
+}
+
+/** Reserve *size* contiguous bytes at the end of queue *q*
+ *
+ * Returns a pointer straight into the ring buffer, so the caller can build the
+ * message in place instead of copying it in with queue_put. Thanks to the
+ * mirrored mapping the whole reservation is contiguous even when it wraps.
+ * Nothing is visible to the consumer until queue_commit is called. In a
+ * QUEUE_FRAMED queue the record header is taken care of.
+ *
+ * Must only be called from the producer thread. Blocks until sufficient space
+ * is available in the queue.
+ */
+uint8_t *queue_reserve(queue_t *q, size_t size)
+{
+    if (!(q->flags & QUEUE_FRAMED))
+        return queue_reserve_bytes(q, size);
+
+    return queue_reserve_bytes(q, queue_frame_size(size)) + QUEUE_FRAME_HEADER;
+}
+
+/** Publish the first *size* bytes of the last reservation on queue *q*
+ *
+ * *size* may be smaller than what was passed to queue_reserve, the rest of the
+ * reservation is simply given back. In a QUEUE_FRAMED queue this publishes
+ * one record of *size* bytes.
+ */
+void queue_commit(queue_t *q, size_t size)
+{
+    queue_count(&q->ctl->p_messages, 1);
+
+    if (!(q->flags & QUEUE_FRAMED)) {
+        queue_commit_bytes(q, size);
+        return;
+    }
+
+    *(size_t *) &q->buffer[q->ctl->tail_off] = size;
+    queue_frame_stamp(&q->buffer[q->ctl->tail_off]);
+    queue_commit_bytes(q, queue_frame_size(size));
+}
+
+/** Insert into queue *q* a message of *size* bytes from *buffer*
+ *
+ * Must only be called from the producer thread. Blocks until sufficient space
+ * is available in the queue.
+ */
+void queue_put(queue_t *q, uint8_t **buffer, size_t size)
+{
+    // Write message, the mirrored second half takes care of wrapping
+    queue_copy_in(queue_reserve(q, size), *buffer, size);
+    *buffer += size;
+
+    queue_commit(q, size);
+}
+
+/* queue_put that gives up like queue_reserve_bytes_until */
+static int queue_put_bounded(queue_t *q, uint8_t **buffer, size_t size,
+                             const struct timespec *deadline, int wait)
+{
+    int framed = q->flags & QUEUE_FRAMED;
+    int err;
+
+    if ((err = queue_reserve_bytes_until(q, framed ? queue_frame_size(size) : size, deadline,
+                                         wait)) != 0)
+        return err;
+
+    queue_copy_in(&q->buffer[q->ctl->tail_off] + (framed ? QUEUE_FRAME_HEADER : 0), *buffer,
+                  size);
+    *buffer += size;
+
+    queue_commit(q, size);
+    return 0;
+}
+
+/** Insert into queue *q* a message of *size* bytes from *buffer* if there is
+ * room for it right now
+ *
+ * Must only be called from the producer thread. Returns 0 if the message went
+ * in, EAGAIN if the queue was too full.
+ */
+int queue_try_put(queue_t *q, uint8_t **buffer, size_t size)
+{
+    return queue_put_bounded(q, buffer, size, NULL, 0);
+}
+
+/** Insert into queue *q* a message of *size* bytes from *buffer*, waiting for
+ * room no longer than until the CLOCK_MONOTONIC time *deadline*
+ *
+ * Must only be called from the producer thread. Returns 0 if the message went
+ * in, ETIMEDOUT if the deadline passed first; the message is not in the queue
+ * then and *buffer* is left alone.
+ */
+int queue_put_until(queue_t *q, uint8_t **buffer, size_t size, const struct timespec *deadline)
+{
+    return queue_put_bounded(q, buffer, size, deadline, 1);
+}
+
+/** Insert into queue *q* the *iovcnt* messages described by *iov*
+ *
+ * All messages that fit into the queue together are copied in under a single
+ * reservation and published with a single index update and at most one
+ * wake-up, instead of paying for both once per message. In a QUEUE_FRAMED
+ * queue every iovec becomes one record. Must only be called from the producer
+ * thread.
+ *
+ * The batches are sized against the ring as it is once the producer has
+ * entered it, and queue_resize refuses to shrink the ring below a batch the
+ * producer waits for room for, so a concurrent resize never makes a batch too
+ * big.
+ */
+void queue_putv(queue_t *q, const struct iovec *iov, int iovcnt)
+{
+    int framed = q->flags & QUEUE_FRAMED;
+
+    while (iovcnt > 0) {
+        size_t total = 0;
+        int n;
+
+        // Take as many whole messages as fit into the queue at once, with the
+        // size queue_resize can't change until we leave again
+        queue_enter(q, &q->ctl->p_active);
+        for (n = 0; n < iovcnt; n++) {
+            size_t len = framed ? queue_frame_size(iov[n].iov_len) : iov[n].iov_len;
+            if (total + len > q->size)
+                break;
+            total += len;
+        }
+        if (n == 0)
+            queue_error("Message size (%lu) exceeds queue size (%lu)",
+                        iov[0].iov_len, q->size);
+
+        queue_reserve_entered(q, total, NULL, 1);
+        uint8_t *dst = &q->buffer[q->ctl->tail_off];
+        for (int i = 0; i < n; i++) {
+            if (framed) {
+                *(size_t *) dst = iov[i].iov_len;
+                queue_frame_stamp(dst);
+                queue_copy_in(dst + QUEUE_FRAME_HEADER, iov[i].iov_base, iov[i].iov_len);
+                dst += queue_frame_size(iov[i].iov_len);
+            } else {
+                queue_copy_in(dst, iov[i].iov_base, iov[i].iov_len);
+                dst += iov[i].iov_len;
+            }
+        }
+        queue_commit_bytes(q, total);
+        queue_count(&q->ctl->p_messages, n);
+
+        iov += n;
+        iovcnt -= n;
+    }
+}
+
+/* queue_peek_until for a consumer that has already entered the ring */
+static inline int queue_peek_entered(queue_t *q, size_t min, const struct timespec *deadline,
+                                     int wait)
+{
+    size_t head = q->ctl->head;
+    int err;
+
+    if (min > q->size)
+        queue_error("Message size (%lu) exceeds queue size (%lu)", min, q->size);
+
+    // Only look at the producer's index when our cached copy says we're empty
+    if (q->ctl->cached_tail - head < min) {
+        q->ctl->cached_tail = __atomic_load_n(&q->ctl->tail, __ATOMIC_ACQUIRE);
+        if (q->ctl->cached_tail - head < min &&
+            (err = wait ? queue_wait_readable(q, head, min, deadline)
+                        : queue_arm_readable(q, head, min)) != 0) {
+            queue_leave(&q->ctl->c_active);
+            return err;
+        }
+    }
+
+    return 0;
+}
+
+/* Wait for at least *min* bytes at &q->buffer[q->ctl->head_off], with the
+ * same *deadline* and *wait* and return values as queue_reserve_bytes_until
+ */
+static inline int queue_peek_until(queue_t *q, size_t min, const struct timespec *deadline,
+                                   int wait)
+{
+    queue_enter(q, &q->ctl->c_active);
+    return queue_peek_entered(q, min, deadline, wait);
+}
+
+/** Wait for at least *min* bytes in queue *q* and return a read-only view of
+ * them in *ptr*
+ *
+ * Returns the number of bytes that can be read at *ptr*, which is everything
+ * pending in the queue capped at *max*. Thanks to the mirrored mapping the
+ * view is contiguous even when it wraps. The bytes stay in the queue until
+ * queue_release is called. This is a raw view, record headers included, use
+ * queue_peek_frames on QUEUE_FRAMED queues.
+ *
+ * Must only be called from the consumer thread.
+ */
+size_t queue_peek(queue_t *q, const uint8_t **ptr, size_t min, size_t max)
+{
+    size_t head = q->ctl->head;
+
+    queue_peek_until(q, min, NULL, 1);
+
+    *ptr = &q->buffer[q->ctl->head_off];
+    return q->ctl->cached_tail - head < max ? q->ctl->cached_tail - head : max;
+}
+
+/** Drop the first *size* bytes of queue *q*, handing the space back to the
+ * producer
+ *
+ * *size* must not exceed what the last queue_peek returned.
+ */
+void queue_release(queue_t *q, size_t size)
+{
+    q->ctl->head_off += size;
+    if (q->ctl->head_off >= q->size)
+        q->ctl->head_off -= q->size;
+
+    // Hand the space back to the producer
+    __atomic_store_n(&q->ctl->head, q->ctl->head + size, __ATOMIC_RELEASE);
+    queue_leave(&q->ctl->c_active);
+    queue_count(&q->ctl->c_bytes, size);
+
+    if (q->flags & QUEUE_SYNC)
+        queue_sync_head(q);
+    else
+        queue_wake(q, &q->ctl->p_waiting, &q->ctl->p_wait_for, q->ctl->head);
+}
+
+/** Wait for at least one record in the QUEUE_FRAMED queue *q* and describe up
+ * to *n* of the pending records in *iov*
+ *
+ * The iovecs point straight into the ring, one whole record each. Returns the
+ * number of records described. They stay in the queue until
+ * queue_release_frames is called with the same iovecs.
+ *
+ * Must only be called from the consumer thread.
+ */
+size_t queue_peek_frames(queue_t *q, struct iovec *iov, size_t n)
+{
+    const uint8_t *frames;
+    size_t i, off = 0;
+
+    if (!(q->flags & QUEUE_FRAMED))
+        queue_error("queue_peek_frames needs a QUEUE_FRAMED queue");
+
+    // Records are committed whole, so a visible header means a visible body
+    size_t avail = queue_peek(q, &frames, QUEUE_FRAME_HEADER, q->size);
+    for (i = 0; i < n && off < avail; i++) {
+        iov[i].iov_base = (void *) (frames + off + QUEUE_FRAME_HEADER);
+        iov[i].iov_len = queue_frame_len(frames + off);
+        off += queue_frame_size(iov[i].iov_len);
+    }
+
+    return i;
+}
+
+/** Drop the *n* records described by *iov* from the QUEUE_FRAMED queue *q* */
+void queue_release_frames(queue_t *q, const struct iovec *iov, size_t n)
+{
+    size_t total = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        queue_count_latency(q, (const uint8_t *) iov[i].iov_base - QUEUE_FRAME_HEADER);
+        total += queue_frame_size(iov[i].iov_len);
+    }
+
+    queue_release(q, total);
+    queue_count(&q->ctl->c_messages, n);
+}
+
+/** Retrieves a message of *size* bytes from queue *q* and writes it to
+ * *buffer*.
+ *
+ * In a QUEUE_FRAMED queue this retrieves exactly one record of at most *size*
+ * bytes, whatever its length. Must only be called from the consumer thread.
+ * Blocks until the message is available. Returns the number of bytes in the
+ * written message.
+ */
+size_t queue_get(queue_t *q, uint8_t **buffer, size_t size)
+{
+    const uint8_t *msg;
+
+    if (q->flags & QUEUE_FRAMED) {
+        queue_peek(q, &msg, QUEUE_FRAME_HEADER, QUEUE_FRAME_HEADER);
+
+        size_t len = queue_frame_len(msg);
+        if (len > size)
+            queue_error("Record size (%lu) exceeds buffer size (%lu)", len, size);
+
+        queue_copy_out(*buffer, msg + QUEUE_FRAME_HEADER, len);
+        *buffer += len;
+
+        queue_count_latency(q, msg);
+        queue_release(q, queue_frame_size(len));
+        queue_count(&q->ctl->c_messages, 1);
+        return len;
+    }
+
+    // Read message body
+    queue_peek(q, &msg, size, size);
+    queue_copy_out(*buffer, msg, size);
+    *buffer += size;
+
+    queue_release(q, size);
+    queue_count(&q->ctl->c_messages, 1);
+
+    return size;
+}
+
+/* queue_get that gives up like queue_peek_until */
+static int queue_get_bounded(queue_t *q, uint8_t **buffer, size_t size,
+                             const struct timespec *deadline, int wait)
+{
+    const uint8_t *msg;
+    int err;
+
+    if (q->flags & QUEUE_FRAMED) {
+        if ((err = queue_peek_until(q, QUEUE_FRAME_HEADER, deadline, wait)) != 0)
+            return err;
+
+        msg = &q->buffer[q->ctl->head_off];
+        size_t len = queue_frame_len(msg);
+        if (len > size)
+            queue_error("Record size (%lu) exceeds buffer size (%lu)", len, size);
+
+        queue_copy_out(*buffer, msg + QUEUE_FRAME_HEADER, len);
+        *buffer += len;
+
+        queue_count_latency(q, msg);
+        queue_release(q, queue_frame_size(len));
+        queue_count(&q->ctl->c_messages, 1);
+        return 0;
+    }
+
+    if ((err = queue_peek_until(q, size, deadline, wait)) != 0)
+        return err;
+
+    queue_copy_out(*buffer, &q->buffer[q->ctl->head_off], size);
+    *buffer += size;
+
+    queue_release(q, size);
+    queue_count(&q->ctl->c_messages, 1);
+    return 0;
+}
+
+/** Retrieve a message of *size* bytes from queue *q* into *buffer* if there
+ * is one right now
+ *
+ * The message is the one queue_get would retrieve, and *buffer* moves past it
+ * the same way, which gives the length of a record in a QUEUE_FRAMED queue.
+ * Must only be called from the consumer thread. Returns 0 if a message was
+ * read, EAGAIN if there was none.
+ */
+int queue_try_get(queue_t *q, uint8_t **buffer, size_t size)
+{
+    return queue_get_bounded(q, buffer, size, NULL, 0);
+}
+
+/** Retrieve a message of *size* bytes from queue *q* into *buffer*, waiting
+ * for it no longer than until the CLOCK_MONOTONIC time *deadline*
+ *
+ * Like queue_try_get otherwise. Returns 0 if a message was read, ETIMEDOUT if
+ * the deadline passed first.
+ */
+int queue_get_until(queue_t *q, uint8_t **buffer, size_t size, const struct timespec *deadline)
+{
+    return queue_get_bounded(q, buffer, size, deadline, 1);
+}
+
+/* Create the eventfd in *efd* unless it exists, and return it */
+static int queue_event_fd(queue_t *q, int *efd)
+{
+    if (q->flags & QUEUE_SHARED)
+        queue_error("Eventfds do not work with QUEUE_SHARED queues");
+
+    if (*efd == -1 && (*efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        queue_error_errno("Could not create eventfd");
+
+    return *efd;
+}
+
+/** Return an eventfd that turns readable when queue *q*, after a
+ * queue_try_get found it empty, gets a message
+ *
+ * This lets a consumer wait for many queues at once with poll or epoll
+ * instead of sleeping in queue_get on one. The eventfd only fires on the
+ * transition a failed queue_try_get asked for, at most once per failure, so
+ * the consumer reads it to clear it and then calls queue_try_get until it
+ * returns EAGAIN again; that last call re-arms it. Must be called by the
+ * consumer before the producer starts using the queue. Not available for
+ * QUEUE_SHARED queues.
+ */
+int queue_readable_fd(queue_t *q)
+{
+    return queue_event_fd(q, &q->c_efd);
+}
+
+/** Return an eventfd that turns readable when queue *q*, after a
+ * queue_try_put found it full, has room for that message
+ *
+ * The producer's counterpart of queue_readable_fd, re-armed by
+ * queue_try_put returning EAGAIN.
+ */
+int queue_writeable_fd(queue_t *q)
+{
+    return queue_event_fd(q, &q->p_efd);
+}
+
+/** Retrieves *iovcnt* messages from queue *q*, the i-th one of
+ * iov[i].iov_len bytes into iov[i].iov_base
+ *
+ * The counterpart of queue_putv: messages are copied out of a single view and
+ * handed back with a single index update. Not available on QUEUE_FRAMED
+ * queues, which batch with queue_peek_frames instead. Batches are sized like
+ * in queue_putv. Must only be called from the consumer thread. Returns the
+ * total number of bytes read.
+ */
+size_t queue_getv(queue_t *q, const struct iovec *iov, int iovcnt)
+{
+    size_t read = 0;
+
+    if (q->flags & QUEUE_FRAMED)
+        queue_error("queue_getv does not support QUEUE_FRAMED queues");
+
+    while (iovcnt > 0) {
+        const uint8_t *src;
+        size_t total = 0;
+        int n;
+
+        queue_enter(q, &q->ctl->c_active);
+        for (n = 0; n < iovcnt && total + iov[n].iov_len <= q->size; n++)
+            total += iov[n].iov_len;
+        if (n == 0)
+            queue_error("Message size (%lu) exceeds queue size (%lu)",
+                        iov[0].iov_len, q->size);
+
+        queue_peek_entered(q, total, NULL, 1);
+        src = &q->buffer[q->ctl->head_off];
+        for (int i = 0; i < n; i++) {
+            queue_copy_out(iov[i].iov_base, src, iov[i].iov_len);
+            src += iov[i].iov_len;
+        }
+        queue_release(q, total);
+        queue_count(&q->ctl->c_messages, n);
+
+        read += total;
+        iov += n;
+        iovcnt -= n;
+    }
+
+    return read;
+}
+
+/** Write up to *max* bytes from the front of queue *q* to *fd*, straight out
+ * of the ring
+ *
+ * Waits for at least one pending byte, then issues a single write(2) of
+ * everything pending up to *max*; the mirrored mapping makes that one
+ * contiguous buffer even across the wrap. Only the bytes the write took are
+ * dropped from the queue. Not available on QUEUE_FRAMED queues, whose
+ * record headers would end up in *fd*. Must only be called from the consumer
+ * thread. Returns what write returned.
+ */
+ssize_t queue_drain_to_fd(queue_t *q, int fd, size_t max)
+{
+    const uint8_t *src;
+    ssize_t ret;
+    size_t n;
+
+    if (q->flags & QUEUE_FRAMED)
+        queue_error("queue_drain_to_fd does not support QUEUE_FRAMED queues");
+
+    // Pick up everything the producer has published so far
+    q->ctl->cached_tail = __atomic_load_n(&q->ctl->tail, __ATOMIC_ACQUIRE);
+    n = queue_peek(q, &src, 1, max);
+
+    if ((ret = write(fd, src, n)) > 0) {
+        queue_release(q, ret);
+    } else {
+        int err = errno;
+        queue_leave(&q->ctl->c_active);
+        errno = err;
+    }
+
+    return ret;
+}
+
+/** Read up to *max* bytes from *fd* into the end of queue *q*, straight into
+ * the ring
+ *
+ * Waits for at least one free byte, then issues a single read(2) into all of
+ * the free space up to *max* and publishes what it got. Not available on
+ * QUEUE_FRAMED queues. Must only be called from the producer thread. Returns
+ * what read returned, 0 at the end of the file.
+ */
+ssize_t queue_fill_from_fd(queue_t *q, int fd, size_t max)
+{
+    uint8_t *dst;
+    ssize_t ret;
+    size_t n;
+
+    if (q->flags & QUEUE_FRAMED)
+        queue_error("queue_fill_from_fd does not support QUEUE_FRAMED queues");
+
+    dst = queue_reserve_bytes(q, 1);
+
+    // Offer all the space the consumer has given back so far
+    n = q->size - (q->ctl->tail - q->ctl->cached_head);
+    if (n < max) {
+        q->ctl->cached_head = queue_load_head(q);
+        n = q->size - (q->ctl->tail - q->ctl->cached_head);
+    }
+
+    if ((ret = read(fd, dst, n < max ? n : max)) > 0) {
+        queue_commit_bytes(q, ret);
+    } else {
+        int err = errno;
+        queue_leave(&q->ctl->p_active);
+        errno = err;
+    }
+
+    return ret;
+}
+
+/** Fill *s* with the statistics of queue *q*
+ *
+ * May be called from any thread, and from either process of a QUEUE_SHARED
+ * queue, while the queue is in use. The counters are read one at a time, so
+ * the snapshot is only consistent to within the messages in flight.
+ */
+void queue_stats(queue_t *q, queue_stats_t *s)
+{
+    queue_ctl_t *ctl = q->ctl;
+
+    s->messages_in = __atomic_load_n(&ctl->p_messages, __ATOMIC_RELAXED);
+    s->bytes_in = __atomic_load_n(&ctl->p_bytes, __ATOMIC_RELAXED);
+    s->messages_out = __atomic_load_n(&ctl->c_messages, __ATOMIC_RELAXED);
+    s->bytes_out = __atomic_load_n(&ctl->c_bytes, __ATOMIC_RELAXED);
+
+    s->put_blocks = __atomic_load_n(&ctl->p_blocks, __ATOMIC_RELAXED);
+    s->put_sleeps = __atomic_load_n(&ctl->p_times, __ATOMIC_RELAXED);
+    s->put_blocked_ns = __atomic_load_n(&ctl->p_blocked_ns, __ATOMIC_RELAXED);
+    s->get_blocks = __atomic_load_n(&ctl->c_blocks, __ATOMIC_RELAXED);
+    s->get_sleeps = __atomic_load_n(&ctl->c_times, __ATOMIC_RELAXED);
+    s->get_blocked_ns = __atomic_load_n(&ctl->c_blocked_ns, __ATOMIC_RELAXED);
+
+    // The head first: the tail only moves on, so it can't end up behind it
+    size_t head = __atomic_load_n(&ctl->head, __ATOMIC_ACQUIRE);
+    s->occupancy = __atomic_load_n(&ctl->tail, __ATOMIC_ACQUIRE) - head;
+    s->high_water = __atomic_load_n(&ctl->high_water, __ATOMIC_RELAXED);
+    for (int i = 0; i < QUEUE_STATS_BUCKETS; i++)
+        s->histogram[i] = __atomic_load_n(&ctl->occupancy[i], __ATOMIC_RELAXED);
+}
+
+#ifdef QUEUE_TIMESTAMPS
+/** Fill *l* with the percentiles of how long the records of the QUEUE_FRAMED
+ * queue *q* sat in the ring, from the commit of the producer to the get or
+ * release of the consumer
+ *
+ * Only available when built with -DQUEUE_TIMESTAMPS. May be called from any
+ * thread of the consumer's process while the queue is in use. Percentiles
+ * are the highest value of the bucket they fall into, so they err by at most
+ * 1 / 2^QUEUE_LATENCY_PRECISION, and upwards; the maximum is exact.
+ */
+void queue_latency(queue_t *q, queue_latency_t *l)
+{
+    uint64_t counts[QUEUE_LATENCY_BUCKETS];
+    uint64_t *pcts[] = {&l->p50, &l->p99, &l->p999};
+    const double ranks[] = {0.5, 0.99, 0.999};
+    uint64_t seen = 0;
+    size_t b = 0;
+
+    l->count = 0;
+    for (size_t i = 0; i < QUEUE_LATENCY_BUCKETS; i++)
+        l->count += counts[i] = __atomic_load_n(&q->latency[i], __ATOMIC_RELAXED);
+    l->max = __atomic_load_n(&q->latency_max, __ATOMIC_RELAXED);
+
+    for (int p = 0; p < 3; p++) {
+        uint64_t rank = (uint64_t) (ranks[p] * l->count + 0.5);
+        if (rank == 0)
+            rank = 1;
+        while (b < QUEUE_LATENCY_BUCKETS - 1 && seen + counts[b] < rank)
+            seen += counts[b++];
+        *pcts[p] = l->count ? queue_latency_value(b) : 0;
+        if (*pcts[p] > l->max)
+            *pcts[p] = l->max;
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef queue_type_h_
+#define queue_type_h_
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "queue_layout.h"
+
+/* Rings specialized for one element type, for queues that carry fixed-size
+ * records. QUEUE_DEFINE_TYPED(name, type, order) defines name_t, a
+ * single-producer / single-consumer ring of 2^order elements of *type*, and
+ * name_init, name_put, name_get, name_put_n and name_get_n to go with it.
+ *
+ * Since the capacity is a constant the index masking compiles to an and and
+ * every element copy to a move of sizeof(type) bytes, where queue_put of
+ * queue_spsc.h does a memcpy of a length only known at run time. The
+ * synchronization is the same: acquire / release indices, a cached copy of
+ * the other side's index, and a waiting flag the other side sleeps on once
+ * it has spun for QUEUE_TYPED_SPIN_LIMIT rounds (none on a single cpu).
+ *
+ * name_t embeds its elements, so it is meant to be a global or allocated
+ * with aligned_alloc rather than put on the stack.
+ */
+
+#ifndef QUEUE_TYPED_SPIN_LIMIT
+#define QUEUE_TYPED_SPIN_LIMIT 4096
+#endif
+
+/* Like queue_error_errno of the other headers, under a name of its own so
+ * that this file can be included next to them
+ */
+static inline void queue_typed_error_errno(const char *msg)
+{
+    fprintf(stderr, "queue error: %s (errno %d)\n", msg, errno);
+    abort();
+}
+
+static inline void queue_typed_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Wait until *index* has moved past *seen*, spinning for *spin* rounds first
+ * and then sleeping on *waiting*, which the other side clears once it moves
+ * the index
+ */
+static inline void queue_typed_wait(size_t *index, size_t seen, int *waiting, uint32_t spin)
+{
+    for (uint32_t i = 0; i < spin; i++) {
+        if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != seen)
+            return;
+        queue_typed_relax();
+    }
+
+    while (__atomic_load_n(index, __ATOMIC_ACQUIRE) == seen) {
+        __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(index, __ATOMIC_ACQUIRE) != seen) {
+            __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+            return;
+        }
+        if (syscall(SYS_futex, waiting, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0) == -1 &&
+            errno != EAGAIN && errno != EINTR)
+            queue_typed_error_errno("Could not wait on futex");
+    }
+}
+
+/* Wake the other side if it sleeps on *waiting*, after moving an index */
+static inline void queue_typed_wake(int *waiting)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(waiting, 0, __ATOMIC_RELAXED))
+        syscall(SYS_futex, waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#define QUEUE_DEFINE_TYPED(name, type, order)                                           \
+    typedef struct {                                                                    \
+        /* producer-owned: write index, last read index the producer has seen and       \
+         * the consumer's waiting flag */                                               \
+        size_t tail queue_cacheline_aligned;                                            \
+        size_t cached_head;                                                             \
+        int c_waiting;                                                                  \
+                                                                                        \
+        /* consumer-owned: the mirror image of the producer's group */                  \
+        size_t head queue_cacheline_aligned;                                            \
+        size_t cached_tail;                                                             \
+        int p_waiting;                                                                  \
+                                                                                        \
+        /* read-only after name_init: how long a side spins before it sleeps */         \
+        uint32_t spin_limit queue_cacheline_aligned;                                    \
+                                                                                        \
+        type slots[(size_t) 1 << (order)] queue_cacheline_aligned;                      \
+    } name##_t;                                                                         \
+                                                                                        \
+    static const size_t name##_capacity = (size_t) 1 << (order);                        \
+                                                                                        \
+    /** Initialize the empty ring *q* */                                                \
+    static inline void name##_init(name##_t *q)                                         \
+    {                                                                                   \
+        q->tail = q->cached_head = q->head = q->cached_tail = 0;                        \
+        q->c_waiting = q->p_waiting = 0;                                                \
+        /* Spinning only pays off when the other side runs on another cpu */            \
+        q->spin_limit = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? QUEUE_TYPED_SPIN_LIMIT : 0; \
+    }                                                                                   \
+                                                                                        \
+    /* Wait until *q* has room for *n* elements past *tail* */                          \
+    static inline void name##_wait_writeable(name##_t *q, size_t tail, size_t n)        \
+    {                                                                                   \
+        while (tail + n - q->cached_head > name##_capacity) {                           \
+            size_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);                  \
+            if (head == q->cached_head)                                                 \
+                queue_typed_wait(&q->head, head, &q->p_waiting, q->spin_limit);         \
+            q->cached_head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);               \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    /* Wait until *q* has *n* elements past *head* */                                   \
+    static inline void name##_wait_readable(name##_t *q, size_t head, size_t n)         \
+    {                                                                                   \
+        while (q->cached_tail - head < n) {                                             \
+            size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);                  \
+            if (tail == q->cached_tail)                                                 \
+                queue_typed_wait(&q->tail, tail, &q->c_waiting, q->spin_limit);         \
+            q->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);               \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    /** Append *elem* to *q*. Must only be called from the producer thread.             \
+     * Blocks while the ring is full. */                                                \
+    static inline void name##_put(name##_t *q, const type *elem)                        \
+    {                                                                                   \
+        size_t tail = q->tail;                                                          \
+                                                                                        \
+        name##_wait_writeable(q, tail, 1);                                              \
+        q->slots[tail & (name##_capacity - 1)] = *elem;                                 \
+        __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);                         \
+        queue_typed_wake(&q->c_waiting);                                                \
+    }                                                                                   \
+                                                                                        \
+    /** Take the oldest element out of *q* into *elem*. Must only be called from        \
+     * the consumer thread. Blocks while the ring is empty. */                          \
+    static inline void name##_get(name##_t *q, type *elem)                              \
+    {                                                                                   \
+        size_t head = q->head;                                                          \
+                                                                                        \
+        name##_wait_readable(q, head, 1);                                               \
+        *elem = q->slots[head & (name##_capacity - 1)];                                 \
+        __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);                         \
+        queue_typed_wake(&q->p_waiting);                                                \
+    }                                                                                   \
+                                                                                        \
+    /** Append the *n* elements of *elems* to *q*, publishing them with one index       \
+     * update and at most one wake-up per batch that fits. Must only be called from     \
+     * the producer thread. */                                                          \
+    static inline void name##_put_n(name##_t *q, const type *elems, size_t n)           \
+    {                                                                                   \
+        while (n > 0) {                                                                 \
+            size_t tail = q->tail;                                                      \
+            size_t batch = n < name##_capacity ? n : name##_capacity;                   \
+                                                                                        \
+            name##_wait_writeable(q, tail, 1);                                          \
+            if (batch > name##_capacity - (tail - q->cached_head))                      \
+                batch = name##_capacity - (tail - q->cached_head);                      \
+            for (size_t i = 0; i < batch; i++)                                          \
+                q->slots[(tail + i) & (name##_capacity - 1)] = elems[i];                \
+            __atomic_store_n(&q->tail, tail + batch, __ATOMIC_RELEASE);                 \
+            queue_typed_wake(&q->c_waiting);                                            \
+            elems += batch;                                                             \
+            n -= batch;                                                                 \
+        }                                                                               \
+    }                                                                                   \
+                                                                                        \
+    /** Take the *n* oldest elements out of *q* into *elems*, the counterpart of        \
+     * name_put_n. Must only be called from the consumer thread. */                     \
+    static inline void name##_get_n(name##_t *q, type *elems, size_t n)                 \
+    {                                                                                   \
+        while (n > 0) {                                                                 \
+            size_t head = q->head;                                                      \
+            size_t batch;                                                               \
+                                                                                        \
+            name##_wait_readable(q, head, 1);                                           \
+            batch = q->cached_tail - head < n ? q->cached_tail - head : n;              \
+            for (size_t i = 0; i < batch; i++)                                          \
+                elems[i] = q->slots[(head + i) & (name##_capacity - 1)];                \
+            __atomic_store_n(&q->head, head + batch, __ATOMIC_RELEASE);                 \
+            queue_typed_wake(&q->p_waiting);                                            \
+            elems += batch;                                                             \
+            n -= batch;                                                                 \
+        }                                                                               \
+    }
+
+#endif
@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_bcast.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define NUM_THREADS (3)
+#define MAX_THREADS (16)
+#define ROUNDS (100)
+#define SIZE_OF_MESSAGE 100ULL
+
+/* One producer sends 65536 size_t's, in messages of SIZE_OF_MESSAGE, and
+ * every consumer receives and checks all of them.
+ */
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_t q;
+    uint32_t messages;
+    uint32_t num_consumers;
+} rbuf_t;
+
+typedef struct {
+    rbuf_t *r;
+    uint32_t id;
+} thread_arg_t;
+
+size_t in[65536];
+size_t out[MAX_THREADS][65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t *publisher_ptr = (uint8_t *) in;
+    for (size_t i = 0; i < r->messages; i += SIZE_OF_MESSAGE) {
+        size_t len = r->messages - i < SIZE_OF_MESSAGE ? r->messages - i : SIZE_OF_MESSAGE;
+        queue_put(&r->q, &publisher_ptr, sizeof(size_t) * len);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    thread_arg_t *t = (thread_arg_t *) arg;
+    rbuf_t *r = t->r;
+    uint8_t *consumer_ptr = (uint8_t *) out[t->id];
+    for (size_t i = 0; i < r->messages; i += SIZE_OF_MESSAGE) {
+        size_t len = r->messages - i < SIZE_OF_MESSAGE ? r->messages - i : SIZE_OF_MESSAGE;
+        queue_get(&r->q, t->id, &consumer_ptr, sizeof(size_t) * len);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t time[ROUNDS];
+    rbuf_t r;
+    r.messages = 65536U;
+    r.num_consumers = NUM_THREADS;
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'm' prefixes the number of size_t's, 'b' the buffer size and 'c' the
+     * number of consumer threads.
+     */
+    for (int arg = 1; arg < argc; arg++) {
+        switch (argv[arg][0]) {
+        case 'm': r.messages = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'b': buffer_size = (size_t) atoi(argv[arg] + 1); break;
+        case 'c': r.num_consumers = (uint32_t) atoi(argv[arg] + 1); break;
+        }
+    }
+    if (r.messages > 65536U)
+        r.messages = 65536U;
+    if (r.num_consumers < 1 || r.num_consumers > MAX_THREADS)
+        r.num_consumers = NUM_THREADS;
+
+    for (size_t i = 0; i < 65536ULL; i++)
+        in[i] = i;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        memset(out, 0, sizeof(out));
+
+        queue_init(&r.q, buffer_size, r.num_consumers);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th[MAX_THREADS];
+        thread_arg_t consumer_arg[MAX_THREADS];
+
+        pthread_create(&publisher_th, NULL, &publisher_loop, &r);
+        for (uint32_t t = 0; t < r.num_consumers; t++) {
+            consumer_arg[t] = (thread_arg_t) { &r, t };
+            pthread_create(&consumer_th[t], NULL, &consumer_loop, &consumer_arg[t]);
+        }
+
+        pthread_join(publisher_th, NULL);
+        for (uint32_t t = 0; t < r.num_consumers; t++)
+            pthread_join(consumer_th[t], NULL);
+
+        time[i] = get_time() - start;
+
+        for (uint32_t t = 0; t < r.num_consumers; t++) {
+            if (memcmp(in, out[t], r.messages * sizeof(size_t)) != 0) {
+                fprintf(stderr, "consumer %u did not receive the sent messages\n", t);
+                return 1;
+            }
+        }
+
+        queue_destroy(&r.q);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    long long avg = 0LL;
+    for (int num = 16; num < 84; num++) {
+        avg += time[num];
+    }
+    avg /= 68;
+    printf("consumers = %u: average run time = %lldus\n", r.num_consumers, avg);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_copy.h"
+
+#define RING_SIZE (32UL << 20)
+#define BYTES_PER_RUN (512UL << 20)
+#define ROUNDS (5)
+
+/* Copy messages of the sizes the SIZE_OF_MESSAGE sweeps use (100 to 500
+ * size_t's) and bigger ones back to back into a ring larger than the caches,
+ * the way a producer fills a queue, with every copy kernel and with
+ * non-temporal stores, and print the bandwidth of each in GB/s.
+ */
+
+static const size_t sizes[] = {64, 800, 1600, 3200, 4000, 16384, 65536, 262144, 1048576};
+static const char *names[] = {"libc", "sse2", "avx2", "avx512"};
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Check one kernel on every length up to 1 KB at every misalignment of the
+ * destination up to a vector
+ */
+static int check(uint8_t *src, uint8_t *dst, int stream)
+{
+    for (size_t off = 0; off < 64; off++) {
+        for (size_t n = 0; n < 1024; n++) {
+            memset(dst, 0, 1024 + 128);
+            if (stream)
+                queue_copy_stream(dst + off, src + 1, n);
+            else
+                queue_copy(dst + off, src + 1, n);
+            if (memcmp(dst + off, src + 1, n) != 0 || dst[off + n] != 0 ||
+                (off && dst[off - 1] != 0))
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static double run(uint8_t *src, uint8_t *ring, size_t size, int stream)
+{
+    uint32_t time[ROUNDS];
+
+    for (int i = 0; i < ROUNDS; i++) {
+        size_t off = 0;
+        uint64_t start = get_time();
+        for (size_t done = 0; done < BYTES_PER_RUN; done += size) {
+            if (off + size > RING_SIZE)
+                off = 0;
+            if (stream)
+                queue_copy_stream(ring + off, src, size);
+            else
+                queue_copy(ring + off, src, size);
+            off += size;
+        }
+        time[i] = get_time() - start;
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    return (double) BYTES_PER_RUN / time[ROUNDS / 2] / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+    uint8_t *src = malloc(1UL << 20), *ring = malloc(RING_SIZE);
+    int kernels = 0;
+
+    for (size_t i = 0; i < (1UL << 20); i++)
+        src[i] = (uint8_t) (i * 7);
+    memset(ring, 0, RING_SIZE);
+
+    for (int k = QUEUE_COPY_LIBC; k <= QUEUE_COPY_AVX512; k++) {
+        if (queue_copy_select(k) != 0)
+            break;
+        queue_copy_set_threshold(0);
+        if (check(src, ring, 0) != 0 || check(src, ring, 1) != 0) {
+            fprintf(stderr, "%s kernel copied wrong bytes\n", names[k]);
+            return 1;
+        }
+        kernels = k + 1;
+    }
+
+    printf("%8s", "size");
+    for (int k = 0; k < kernels; k++)
+        printf(" %8s", names[k]);
+    for (int k = 1; k < kernels; k++)
+        printf(" %5s-nt", names[k]);
+    printf("\n");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        printf("%8lu", sizes[s]);
+        queue_copy_set_threshold((size_t) -1);
+        for (int k = 0; k < kernels; k++) {
+            queue_copy_select(k);
+            printf(" %8.2f", run(src, ring, sizes[s], 0));
+        }
+        queue_copy_set_threshold(0);
+        for (int k = 1; k < kernels; k++) {
+            queue_copy_select(k);
+            printf(" %8.2f", run(src, ring, sizes[s], 1));
+        }
+        printf("\n");
+    }
+
+    free(src);
+    free(ring);
+    return 0;
+}
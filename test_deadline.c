@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define MESSAGES (1U << 20)
+#define TIMEOUT_US 20000
+
+/* Check that queue_try_put / queue_try_get return EAGAIN on a full / empty
+ * queue and that queue_put_until / queue_get_until return ETIMEDOUT at their
+ * deadline, then stream MESSAGES messages to a slow consumer through a
+ * QUEUE_FRAMED queue with a producer that sheds what doesn't fit, and check
+ * that whatever got through arrived in order.
+ */
+
+typedef struct {
+    queue_t q;
+    uint32_t shed, received;
+    int done, error;
+} rbuf_t;
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* CLOCK_MONOTONIC deadline *us* microseconds from now */
+static struct timespec deadline_in(long us)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_nsec += us * 1000;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    return ts;
+}
+
+static void fail(const char *what)
+{
+    fprintf(stderr, "%s\n", what);
+    exit(1);
+}
+
+static void check_bounds(void)
+{
+    queue_t q;
+    size_t v = 0, n = 0;
+    uint8_t *ptr = (uint8_t *) &v;
+
+    queue_init(&q, BUFFER_SIZE);
+
+    if (queue_try_get(&q, &ptr, sizeof(v)) != EAGAIN || ptr != (uint8_t *) &v)
+        fail("queue_try_get on an empty queue did not return EAGAIN");
+
+    struct timespec deadline = deadline_in(TIMEOUT_US);
+    uint64_t start = get_time();
+    if (queue_get_until(&q, &ptr, sizeof(v), &deadline) != ETIMEDOUT)
+        fail("queue_get_until on an empty queue did not time out");
+    printf("queue_get_until: timed out after %lluus of %dus\n",
+           (unsigned long long) (get_time() - start), TIMEOUT_US);
+
+    for (;; n++) {
+        ptr = (uint8_t *) &n;
+        if (queue_try_put(&q, &ptr, sizeof(n)) == EAGAIN)
+            break;
+    }
+    if (n != q.size / sizeof(n))
+        fail("queue_try_put did not fill the queue");
+
+    deadline = deadline_in(TIMEOUT_US);
+    start = get_time();
+    if (queue_put_until(&q, &ptr, sizeof(n), &deadline) != ETIMEDOUT)
+        fail("queue_put_until on a full queue did not time out");
+    printf("queue_put_until: timed out after %lluus of %dus\n",
+           (unsigned long long) (get_time() - start), TIMEOUT_US);
+
+    for (size_t i = 0; i < n; i++) {
+        ptr = (uint8_t *) &v;
+        if (queue_try_get(&q, &ptr, sizeof(v)) != 0 || v != i)
+            fail("queue_try_get did not return the queued messages");
+    }
+
+    queue_destroy(&q);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < MESSAGES; i++) {
+        uint8_t *publisher_ptr = (uint8_t *) &i;
+        if (queue_try_put(&r->q, &publisher_ptr, sizeof(i)) == EAGAIN)
+            r->shed++;
+    }
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Every 1024 messages the consumer stalls for a while */
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t last = 0;
+
+    for (;;) {
+        size_t i;
+        uint8_t *consumer_ptr = (uint8_t *) &i;
+        struct timespec deadline = deadline_in(TIMEOUT_US);
+        if (queue_get_until(&r->q, &consumer_ptr, sizeof(i), &deadline) == ETIMEDOUT) {
+            if (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE))
+                break;
+            continue;
+        }
+        if (consumer_ptr != (uint8_t *) &i + sizeof(i) || (r->received && i <= last))
+            r->error = 1;
+        last = i;
+        if (++r->received % 1024 == 0)
+            usleep(100);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    rbuf_t r;
+    r.shed = r.received = 0;
+    r.done = r.error = 0;
+
+    check_bounds();
+
+    queue_init_flags(&r.q, BUFFER_SIZE, QUEUE_FRAMED);
+
+    uint64_t start = get_time();
+
+    pthread_t publisher_th, consumer_th;
+    pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+    pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+    pthread_join(publisher_th, NULL);
+    pthread_join(consumer_th, NULL);
+
+    uint64_t end = get_time();
+
+    if (r.error || r.received + r.shed != MESSAGES)
+        fail("received messages do not match the sent ones");
+
+    printf("shedding producer: %u of %u messages shed, %u received in order in %lluus\n",
+           r.shed, MESSAGES, r.received, (unsigned long long) (end - start));
+
+    queue_destroy(&r.q);
+
+    return 0;
+}
@@ -105,6 +105,11 @@ int main(int argc, char *argv[])
 
         time[i] = end - start;
 
+        if (memcmp(in, out, r.messages_per_thread * sizeof(size_t)) != 0) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            return 1;
+        }
+
         pthread_attr_destroy(&attr);
 
         queue_destroy(&r.q);
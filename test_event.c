@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include <sys/epoll.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define NUM_QUEUES (64)
+#define MAX_QUEUES (4096)
+#define MESSAGES (1U << 16)
+
+/* One producer thread feeds NUM_QUEUES queues and one consumer thread drains
+ * them, both without ever blocking in the queue: they multiplex all queues
+ * with epoll on queue_writeable_fd and queue_readable_fd and move messages
+ * with queue_try_put and queue_try_get. Every queue carries MESSAGES size_t's
+ * counting up, which the consumer checks. Also checks that a producer that
+ * only armed its eventfd doesn't keep queue_resize from shrinking the ring.
+ */
+
+typedef struct {
+    queue_t q[MAX_QUEUES];
+    uint32_t num_queues;
+    uint32_t p_events, c_events;
+    int error;
+} rbuf_t;
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static int watch(rbuf_t *r, int (*fd)(queue_t *))
+{
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    for (uint32_t i = 0; i < r->num_queues; i++) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.u32 = i};
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd(&r->q[i]), &ev);
+    }
+    return ep;
+}
+
+/* Put into queue *i* until it is full or done, returns 1 once done */
+static int fill(rbuf_t *r, uint32_t i, size_t *next)
+{
+    while (next[i] < MESSAGES) {
+        uint8_t *publisher_ptr = (uint8_t *) &next[i];
+        if (queue_try_put(&r->q[i], &publisher_ptr, sizeof(size_t)) == EAGAIN)
+            return 0;
+        next[i]++;
+    }
+    return 1;
+}
+
+/* Get from queue *i* until it is empty, returns 1 once everything arrived */
+static int drain(rbuf_t *r, uint32_t i, size_t *next)
+{
+    while (next[i] < MESSAGES) {
+        size_t v;
+        uint8_t *consumer_ptr = (uint8_t *) &v;
+        if (queue_try_get(&r->q[i], &consumer_ptr, sizeof(v)) == EAGAIN)
+            return 0;
+        if (v != next[i]++)
+            r->error = 1;
+    }
+    return 1;
+}
+
+static void loop(rbuf_t *r, int (*fd)(queue_t *), int (*move)(rbuf_t *, uint32_t, size_t *),
+                 uint32_t *events)
+{
+    static __thread size_t next[MAX_QUEUES];
+    struct epoll_event ev[64];
+    uint32_t left = 0;
+    int ep = watch(r, fd);
+
+    // A first pass arms every queue that can't be finished right away
+    for (uint32_t i = 0; i < r->num_queues; i++) {
+        next[i] = 0;
+        left += !move(r, i, next);
+    }
+
+    while (left > 0) {
+        int n = epoll_wait(ep, ev, 64, -1);
+        for (int e = 0; e < n; e++) {
+            uint32_t i = ev[e].data.u32;
+            uint64_t count;
+            if (read(fd(&r->q[i]), &count, sizeof(count)) != sizeof(count))
+                continue;
+            (*events)++;
+            if (next[i] < MESSAGES && move(r, i, next))
+                left--;
+        }
+    }
+    close(ep);
+}
+
+/* Arm the writeable eventfd with a put of the whole ring while half of it is
+ * pending, then shrink the ring to that half: nobody sleeps, so the resize
+ * goes through and signals the eventfd for the producer to try again
+ */
+static int check_armed_resize(void)
+{
+    size_t page = getpagesize();
+    uint8_t *in = calloc(2, page);
+    uint8_t *publisher_ptr = in;
+    uint64_t count;
+    queue_t q;
+    int err = 0;
+
+    queue_init(&q, 2 * page);
+    int efd = queue_writeable_fd(&q);
+    queue_put(&q, &publisher_ptr, page);
+    publisher_ptr = in;
+    if (queue_try_put(&q, &publisher_ptr, 2 * page) != EAGAIN ||
+        queue_resize(&q, page) != 0 || read(efd, &count, sizeof(count)) != sizeof(count))
+        err = 1;
+    queue_destroy(&q);
+    free(in);
+    return err;
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    loop(r, queue_writeable_fd, fill, &r->p_events);
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    loop(r, queue_readable_fd, drain, &r->c_events);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    static rbuf_t r;
+    r.num_queues = NUM_QUEUES;
+
+    /* 'n' prefixes the number of queues */
+    for (int arg = 1; arg < argc; arg++) {
+        if (argv[arg][0] == 'n')
+            r.num_queues = (uint32_t) atoi(argv[arg] + 1);
+    }
+    if (r.num_queues < 1 || r.num_queues > MAX_QUEUES)
+        r.num_queues = NUM_QUEUES;
+
+    if (check_armed_resize()) {
+        fprintf(stderr, "an armed eventfd kept queue_resize from shrinking the ring\n");
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < r.num_queues; i++) {
+        queue_init(&r.q[i], BUFFER_SIZE);
+        queue_writeable_fd(&r.q[i]);
+        queue_readable_fd(&r.q[i]);
+    }
+
+    uint64_t start = get_time();
+
+    pthread_t publisher_th, consumer_th;
+    pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+    pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+    pthread_join(publisher_th, NULL);
+    pthread_join(consumer_th, NULL);
+
+    uint64_t end = get_time();
+
+    if (r.error) {
+        fprintf(stderr, "received messages do not match the sent ones\n");
+        return 1;
+    }
+
+    printf("%u queues, %u messages each: %lluus, %u writeable and %u readable events\n",
+           r.num_queues, MESSAGES, (unsigned long long) (end - start), r.p_events, r.c_events);
+
+    for (uint32_t i = 0; i < r.num_queues; i++)
+        queue_destroy(&r.q[i]);
+
+    return 0;
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include <sys/resource.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize() * 64)
+#define ROUNDS (100)
+#define SIZE_OF_MESSAGE 100ULL
+
+/* The test_con_* workload, one producer sending 65536 size_t's in messages of
+ * SIZE_OF_MESSAGE to one consumer, on a fresh queue every round: plain,
+ * QUEUE_PREFAULT and QUEUE_MLOCK. Prints the run time and the page faults the
+ * process took from the start of the threads to their end.
+ */
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_t q;
+    uint32_t messages;
+} rbuf_t;
+
+size_t in[65536];
+size_t out[65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Minor and major page faults of the whole process so far */
+static long get_faults()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t *publisher_ptr = (uint8_t *) in;
+    for (size_t i = 0; i < r->messages; i += SIZE_OF_MESSAGE) {
+        size_t len = r->messages - i < SIZE_OF_MESSAGE ? r->messages - i : SIZE_OF_MESSAGE;
+        queue_put(&r->q, &publisher_ptr, sizeof(size_t) * len);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t *consumer_ptr = (uint8_t *) out;
+    for (size_t i = 0; i < r->messages; i += SIZE_OF_MESSAGE) {
+        size_t len = r->messages - i < SIZE_OF_MESSAGE ? r->messages - i : SIZE_OF_MESSAGE;
+        queue_get(&r->q, &consumer_ptr, sizeof(size_t) * len);
+    }
+    return NULL;
+}
+
+static void run(const char *name, rbuf_t *r, size_t buffer_size, unsigned int flags)
+{
+    uint32_t time[ROUNDS];
+    long faults = 0;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        memset(out, 0, sizeof(out));
+
+        queue_init_flags(&r->q, buffer_size, flags);
+
+        long start_faults = get_faults();
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th;
+        pthread_create(&publisher_th, NULL, &publisher_loop, r);
+        pthread_create(&consumer_th, NULL, &consumer_loop, r);
+        pthread_join(publisher_th, NULL);
+        pthread_join(consumer_th, NULL);
+
+        time[i] = get_time() - start;
+        faults += get_faults() - start_faults;
+
+        if (memcmp(in, out, r->messages * sizeof(size_t)) != 0) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            exit(1);
+        }
+
+        queue_destroy(&r->q);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    printf("%-8s: median run time = %uus, %ld page faults per run\n", name, time[ROUNDS / 2],
+           faults / ROUNDS);
+}
+
+int main(int argc, char *argv[])
+{
+    rbuf_t r;
+    r.messages = 65536U;
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'm' prefixes the number of size_t's and 'b' the buffer size */
+    for (int arg = 1; arg < argc; arg++) {
+        if (argv[arg][0] == 'm')
+            r.messages = (uint32_t) atoi(argv[arg] + 1);
+        if (argv[arg][0] == 'b')
+            buffer_size = (size_t) atoi(argv[arg] + 1);
+    }
+    if (r.messages > 65536U)
+        r.messages = 65536U;
+
+    for (size_t i = 0; i < 65536ULL; i++)
+        in[i] = i;
+
+    run("plain", &r, buffer_size, 0);
+    run("prefault", &r, buffer_size, QUEUE_PREFAULT);
+    run("mlock", &r, buffer_size, QUEUE_MLOCK);
+
+    return 0;
+}
@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize() * 64)
+#define CHUNK (64 * 1024)
+#define TOTAL (256UL << 20)
+
+/* Move TOTAL bytes through a queue and a pipe, once queue -> pipe and once
+ * pipe -> queue, each with a bounce buffer (queue_get + write, read +
+ * queue_put) and straight from / into the ring (queue_drain_to_fd,
+ * queue_fill_from_fd). The byte stream is checked on the far end.
+ */
+
+typedef struct {
+    queue_t q;
+    int pipe[2];
+    int direct;
+    int error;
+} rbuf_t;
+
+/* Byte k of the stream is pattern[k % 251] */
+uint8_t pattern[CHUNK + 251];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static int check(const uint8_t *buf, size_t len, size_t offset)
+{
+    return memcmp(buf, pattern + offset % 251, len) != 0;
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = write(fd, buf, len);
+        if (ret <= 0)
+            queue_error_errno("Could not write to pipe");
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* queue -> pipe: the producer puts the stream into the queue */
+static void *put_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t done = 0; done < TOTAL; done += CHUNK) {
+        uint8_t *publisher_ptr = pattern + done % 251;
+        queue_put(&r->q, &publisher_ptr, CHUNK);
+    }
+    return NULL;
+}
+
+/* queue -> pipe: the consumer moves the queue to the pipe */
+static void *drain_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t *buf = malloc(CHUNK);
+    for (size_t done = 0; done < TOTAL;) {
+        if (r->direct) {
+            ssize_t ret = queue_drain_to_fd(&r->q, r->pipe[1], TOTAL - done);
+            if (ret <= 0)
+                queue_error_errno("Could not drain queue");
+            done += ret;
+        } else {
+            uint8_t *consumer_ptr = buf;
+            queue_get(&r->q, &consumer_ptr, CHUNK);
+            write_all(r->pipe[1], buf, CHUNK);
+            done += CHUNK;
+        }
+    }
+    close(r->pipe[1]);
+    free(buf);
+    return NULL;
+}
+
+/* queue -> pipe: read the pipe and check the stream */
+static void *read_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t *buf = malloc(CHUNK);
+    size_t done = 0;
+    ssize_t ret;
+    while ((ret = read(r->pipe[0], buf, CHUNK)) > 0) {
+        r->error |= check(buf, ret, done);
+        done += ret;
+    }
+    r->error |= done != TOTAL;
+    free(buf);
+    return NULL;
+}
+
+/* pipe -> queue: write the stream to the pipe */
+static void *write_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t done = 0; done < TOTAL; done += CHUNK)
+        write_all(r->pipe[1], pattern + done % 251, CHUNK);
+    close(r->pipe[1]);
+    return NULL;
+}
+
+/* pipe -> queue: the producer moves the pipe to the queue */
+static void *fill_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t *buf = malloc(CHUNK);
+    ssize_t ret;
+    do {
+        if (r->direct) {
+            ret = queue_fill_from_fd(&r->q, r->pipe[0], CHUNK);
+        } else if ((ret = read(r->pipe[0], buf, CHUNK)) > 0) {
+            uint8_t *publisher_ptr = buf;
+            queue_put(&r->q, &publisher_ptr, ret);
+        }
+    } while (ret > 0);
+    free(buf);
+    return NULL;
+}
+
+/* pipe -> queue: the consumer checks the stream, in whatever pieces it has */
+static void *get_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t done = 0; done < TOTAL;) {
+        const uint8_t *src;
+        size_t n = queue_peek(&r->q, &src, 1, TOTAL - done < CHUNK ? TOTAL - done : CHUNK);
+        r->error |= check(src, n, done);
+        queue_release(&r->q, n);
+        done += n;
+    }
+    return NULL;
+}
+
+static void run(const char *name, void *(*first)(void *), void *(*second)(void *),
+                void *(*third)(void *), int direct)
+{
+    rbuf_t r;
+    r.direct = direct;
+    r.error = 0;
+
+    queue_init(&r.q, BUFFER_SIZE);
+    if (pipe(r.pipe) != 0)
+        queue_error_errno("Could not create pipe");
+
+    uint64_t start = get_time();
+
+    pthread_t th[3];
+    pthread_create(&th[0], NULL, first, (void *) &r);
+    pthread_create(&th[1], NULL, second, (void *) &r);
+    pthread_create(&th[2], NULL, third, (void *) &r);
+    for (int i = 0; i < 3; i++)
+        pthread_join(th[i], NULL);
+
+    uint64_t end = get_time();
+
+    if (r.error) {
+        fprintf(stderr, "%s: received stream does not match the sent one\n", name);
+        exit(1);
+    }
+
+    printf("%-20s: %lluus (%.1f MB/s)\n", name, (unsigned long long) (end - start),
+           (double) TOTAL / (end - start));
+
+    close(r.pipe[0]);
+    queue_destroy(&r.q);
+}
+
+int main(int argc, char *argv[])
+{
+    for (size_t i = 0; i < sizeof(pattern); i++)
+        pattern[i] = (uint8_t) (i % 251 * 7);
+
+    run("queue_get + write", put_loop, drain_loop, read_loop, 0);
+    run("queue_drain_to_fd", put_loop, drain_loop, read_loop, 1);
+    run("read + queue_put", write_loop, fill_loop, get_loop, 0);
+    run("queue_fill_from_fd", write_loop, fill_loop, get_loop, 1);
+
+    return 0;
+}
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize() * 16)
+#define ROUNDS 20
+#define RECORDS 20000
+#define MIN_RECORD 16
+#define MAX_RECORD 8192
+#define BATCH 32
+
+/* Send records of mixed sizes between MIN_RECORD and MAX_RECORD bytes through
+ * a QUEUE_FRAMED queue, received once record by record with queue_get and
+ * once in batches with queue_peek_frames.
+ */
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_t q;
+    int batched;
+    int error;
+} rbuf_t;
+
+size_t lengths[RECORDS];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Record *i* is lengths[i] bytes of (i + j) & 0xff */
+static int check(const uint8_t *rec, size_t len, size_t i)
+{
+    return len == lengths[i] && rec[0] == (uint8_t) i &&
+           rec[len - 1] == (uint8_t) (i + len - 1);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t rec[MAX_RECORD];
+    for (size_t i = 0; i < RECORDS; i++) {
+        uint8_t *publisher_ptr = rec;
+        for (size_t j = 0; j < lengths[i]; j++)
+            rec[j] = (uint8_t) (i + j);
+        queue_put(&r->q, &publisher_ptr, lengths[i]);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t rec[MAX_RECORD];
+    struct iovec iov[BATCH];
+    size_t i = 0;
+
+    while (i < RECORDS) {
+        if (!r->batched) {
+            uint8_t *consumer_ptr = rec;
+            size_t len = queue_get(&r->q, &consumer_ptr, sizeof(rec));
+            if (!check(rec, len, i++))
+                r->error = 1;
+            continue;
+        }
+        size_t n = queue_peek_frames(&r->q, iov, BATCH);
+        for (size_t k = 0; k < n; k++)
+            if (!check(iov[k].iov_base, iov[k].iov_len, i++))
+                r->error = 1;
+        queue_release_frames(&r->q, iov, n);
+    }
+    return NULL;
+}
+
+static long long run(int batched, size_t buffer_size)
+{
+    uint32_t time[ROUNDS];
+    for (int i = 0; i < ROUNDS; i++) {
+        rbuf_t r;
+        r.batched = batched;
+        r.error = 0;
+
+        queue_init_flags(&r.q, buffer_size, QUEUE_FRAMED);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th;
+        pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+        pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+        pthread_join(publisher_th, NULL);
+        pthread_join(consumer_th, NULL);
+
+        time[i] = get_time() - start;
+
+        if (r.error) {
+            fprintf(stderr, "received records do not match the sent ones\n");
+            exit(1);
+        }
+
+        queue_destroy(&r.q);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    long long avg = 0LL;
+    for (int num = ROUNDS * 16 / 100; num < ROUNDS * 84 / 100; num++)
+        avg += time[num];
+    return avg / (ROUNDS * 84 / 100 - ROUNDS * 16 / 100);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t buffer_size = BUFFER_SIZE;
+    size_t total = 0, framed = 0;
+    uint32_t seed = 1;
+
+    /* 'b' prefixes the buffer size */
+    for (int arg = 1; arg < argc; arg++)
+        if (argv[arg][0] == 'b')
+            buffer_size = (size_t) atoi(argv[arg] + 1);
+
+    for (size_t i = 0; i < RECORDS; i++) {
+        seed = seed * 1103515245 + 12345;
+        lengths[i] = MIN_RECORD + (seed >> 8) % (MAX_RECORD - MIN_RECORD + 1);
+        total += lengths[i];
+        framed += queue_frame_size(lengths[i]);
+    }
+
+    printf("payload %zu bytes, framed %zu bytes, padded to %d bytes %zu bytes\n",
+           total, framed, MAX_RECORD, (size_t) RECORDS * MAX_RECORD);
+
+    long long t = run(0, buffer_size);
+    printf("queue_get         : average run time = %lldus (%.1f MB/s)\n", t, (double) total / t);
+    t = run(1, buffer_size);
+    printf("queue_peek_frames : average run time = %lldus (%.1f MB/s)\n", t, (double) total / t);
+
+    return 0;
+}
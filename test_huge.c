@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (64UL << 20)
+#define LAPS 4
+#define SIZE_OF_MESSAGE (64UL << 10)
+
+/* Stream LAPS laps of a large ring, once backed by regular pages and once
+ * with QUEUE_HUGETLB, and report the dTLB load misses of both runs.
+ *
+ * Every message must arrive intact. The QUEUE_HUGETLB ring must come from
+ * the hugetlb pool if it has enough free 2 MB pages, and otherwise from the
+ * fallback: regular shmem pages (transparent huge pages where shmem_enabled
+ * allows them), with both halves of the mirror still 2 MB aligned. A shared
+ * QUEUE_HUGETLB ring must also start 2 MB into its memfd either way.
+ */
+
+typedef struct {
+    queue_t q;
+    size_t messages;
+    int error;
+} rbuf_t;
+
+uint8_t in[SIZE_OF_MESSAGE];
+uint8_t out[SIZE_OF_MESSAGE];
+
+/* Free bytes in the 2 MB hugetlb pool, from /proc/meminfo */
+static size_t hugetlb_free(void)
+{
+    FILE *f = fopen("/proc/meminfo", "r");
+    char line[128];
+    size_t pages = 0;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "HugePages_Free: %zu", &pages) == 1)
+            break;
+    fclose(f);
+    return pages * QUEUE_HUGE_PAGE_SIZE;
+}
+
+/* What shmem_enabled says about transparent huge pages for the fallback */
+static const char *thp_mode(void)
+{
+    static char mode[32] = "n/a";
+    char line[128], *start, *end;
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/shmem_enabled", "r");
+
+    if (!f)
+        return mode;
+    if (fgets(line, sizeof(line), f) && (start = strchr(line, '[')) &&
+        (end = strchr(start, ']')) && end - start < (long) sizeof(mode)) {
+        memcpy(mode, start + 1, end - start - 1);
+        mode[end - start - 1] = 0;
+    }
+    fclose(f);
+    return mode;
+}
+
+/* Message *i* is in[] with its number in the first bytes */
+static void fill(size_t i)
+{
+    memcpy(in, &i, sizeof(i));
+}
+
+static int check(size_t i)
+{
+    return memcmp(out, &i, sizeof(i)) == 0 &&
+           memcmp(out + sizeof(i), in + sizeof(i), SIZE_OF_MESSAGE - sizeof(i)) == 0;
+}
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Count dTLB load misses of this thread and the threads it starts from now
+ * on. Returns -1 if the kernel or the hypervisor does not let us.
+ */
+static int dtlb_counter_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < r->messages; i++) {
+        uint8_t *publisher_ptr = in;
+        fill(i);
+        queue_put(&r->q, &publisher_ptr, SIZE_OF_MESSAGE);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < r->messages; i++) {
+        uint8_t *consumer_ptr = out;
+        queue_get(&r->q, &consumer_ptr, SIZE_OF_MESSAGE);
+        if (!check(i))
+            r->error = 1;
+    }
+    return NULL;
+}
+
+static void run(unsigned int flags, size_t buffer_size)
+{
+    rbuf_t r;
+    long long misses = -1;
+    size_t pool = hugetlb_free();
+
+    queue_init_flags(&r.q, buffer_size, flags);
+    r.messages = LAPS * r.q.size / SIZE_OF_MESSAGE;
+    r.error = 0;
+
+    if (flags & QUEUE_HUGETLB) {
+        size_t header = flags & QUEUE_SHARED ? QUEUE_HUGE_PAGE_SIZE : 0;
+        size_t expect = pool >= header + r.q.size ? QUEUE_HUGE_PAGE_SIZE : (size_t) getpagesize();
+        if (r.q.size % QUEUE_HUGE_PAGE_SIZE != 0 ||
+            (uintptr_t) r.q.buffer % QUEUE_HUGE_PAGE_SIZE != 0 || r.q.page_size != expect ||
+            ((flags & QUEUE_SHARED) && r.q.ctl->header_size != header)) {
+            fprintf(stderr, "hugetlb pool has %lu MB free, but got a ring of %lu bytes at "
+                    "%p with page size %lu\n", pool >> 20, r.q.size, (void *) r.q.buffer,
+                    r.q.page_size);
+            exit(1);
+        }
+        printf("hugetlb pool has %lu MB free, %s (shmem THP: %s)\n", pool >> 20,
+               expect == QUEUE_HUGE_PAGE_SIZE ? "using it" : "falling back to shmem",
+               thp_mode());
+    }
+
+    int fd = dtlb_counter_open();
+
+    uint64_t start = get_time();
+
+    pthread_t publisher_th, consumer_th;
+    pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+    pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+    pthread_join(publisher_th, NULL);
+    pthread_join(consumer_th, NULL);
+
+    uint64_t end = get_time();
+
+    if (r.error) {
+        fprintf(stderr, "received messages do not match the sent ones\n");
+        exit(1);
+    }
+
+    if (fd != -1) {
+        if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+            misses = -1;
+        close(fd);
+    }
+
+    printf("%-8s page size %7lu: %.1f MB/s, ", flags & QUEUE_HUGETLB ? "hugetlb" : "default",
+           r.q.page_size, (double) r.messages * SIZE_OF_MESSAGE / (end - start));
+    if (misses < 0)
+        printf("dTLB load misses n/a\n");
+    else
+        printf("dTLB load misses %lld\n", misses);
+
+    queue_destroy(&r.q);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'b' prefixes the buffer size in MB */
+    for (int arg = 1; arg < argc; arg++)
+        if (argv[arg][0] == 'b')
+            buffer_size = (size_t) atoi(argv[arg] + 1) << 20;
+
+    for (size_t j = 0; j < sizeof(in); j++)
+        in[j] = (uint8_t) (j * 7 + 3);
+
+    run(0, buffer_size);
+    run(QUEUE_HUGETLB, buffer_size);
+    run(QUEUE_HUGETLB | QUEUE_SHARED, buffer_size);
+
+    return 0;
+}
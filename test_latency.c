@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#define QUEUE_TIMESTAMPS
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define SIZE_OF_MESSAGE 100ULL
+
+/* One producer sends 65536 size_t's 100 times over, in records of
+ * SIZE_OF_MESSAGE, through a timestamped QUEUE_FRAMED queue, to a consumer
+ * that spins for a while after every record, and prints the percentiles of
+ * how long the records sat in the ring. A second run has the consumer use
+ * queue_peek_frames instead of queue_get. Also checks that the latency
+ * histogram buckets are as precise as promised.
+ */
+
+typedef struct {
+    queue_t q;
+    uint32_t messages;
+    uint32_t rounds;
+    uint32_t work;
+    int batched;
+} rbuf_t;
+
+size_t in[65536];
+size_t out[65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (uint32_t round = 0; round < r->rounds; round++) {
+        uint8_t *publisher_ptr = (uint8_t *) in;
+        for (size_t i = 0; i < r->messages; i += SIZE_OF_MESSAGE) {
+            size_t len = r->messages - i < SIZE_OF_MESSAGE ? r->messages - i : SIZE_OF_MESSAGE;
+            queue_put(&r->q, &publisher_ptr, sizeof(size_t) * len);
+        }
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    struct iovec iov[16];
+    uint64_t records = (uint64_t) r->rounds * ((r->messages + SIZE_OF_MESSAGE - 1) / SIZE_OF_MESSAGE);
+    size_t pos = 0;
+    /* Records never straddle two rounds, so every round starts over at the
+     * beginning of out
+     */
+    while (records > 0) {
+        size_t n = 1;
+        if (r->batched) {
+            n = queue_peek_frames(&r->q, iov, 16);
+            for (size_t k = 0; k < n; k++) {
+                memcpy(&out[pos], iov[k].iov_base, iov[k].iov_len);
+                pos += iov[k].iov_len / sizeof(size_t);
+                if (pos == r->messages)
+                    pos = 0;
+            }
+            queue_release_frames(&r->q, iov, n);
+        } else {
+            uint8_t *consumer_ptr = (uint8_t *) &out[pos];
+            pos += queue_get(&r->q, &consumer_ptr, sizeof(size_t) * SIZE_OF_MESSAGE) /
+                   sizeof(size_t);
+            if (pos == r->messages)
+                pos = 0;
+        }
+        records -= n;
+        for (size_t k = 0; k < n; k++)
+            for (volatile uint32_t w = 0; w < r->work; w++)
+                ;
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    rbuf_t r;
+    r.messages = 65536U;
+    r.rounds = 100;
+    r.work = 0;
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'm' prefixes the number of size_t's per round, 'r' the number of
+     * rounds, 'b' the buffer size and 'w' the spins the consumer does per
+     * record.
+     */
+    for (int arg = 1; arg < argc; arg++) {
+        switch (argv[arg][0]) {
+        case 'm': r.messages = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'r': r.rounds = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'b': buffer_size = (size_t) atoi(argv[arg] + 1); break;
+        case 'w': r.work = (uint32_t) atoi(argv[arg] + 1); break;
+        }
+    }
+    if (r.messages > 65536U)
+        r.messages = 65536U;
+
+    for (uint64_t ns = 0; ns < (1ULL << QUEUE_LATENCY_RANGE); ns = ns * 9 / 8 + 1) {
+        size_t bucket = queue_latency_bucket(ns);
+        uint64_t value = queue_latency_value(bucket);
+        if (bucket >= QUEUE_LATENCY_BUCKETS || value < ns ||
+            value - ns > ns >> QUEUE_LATENCY_PRECISION ||
+            (bucket > 0 && queue_latency_value(bucket - 1) >= ns)) {
+            fprintf(stderr, "%lu ns lands in bucket %lu, which goes up to %lu ns\n", ns,
+                    bucket, value);
+            return 1;
+        }
+    }
+
+    for (size_t i = 0; i < 65536ULL; i++)
+        in[i] = i;
+
+    const char *names[] = {"queue_get", "queue_peek_frames"};
+    for (r.batched = 0; r.batched < 2; r.batched++) {
+        memset(out, 0, sizeof(out));
+        queue_init_flags(&r.q, buffer_size, QUEUE_FRAMED);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th;
+        pthread_create(&publisher_th, NULL, &publisher_loop, &r);
+        pthread_create(&consumer_th, NULL, &consumer_loop, &r);
+
+        pthread_join(publisher_th, NULL);
+        pthread_join(consumer_th, NULL);
+
+        uint64_t time = get_time() - start;
+
+        if (memcmp(in, out, r.messages * sizeof(size_t)) != 0) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            return 1;
+        }
+
+        queue_latency_t l;
+        queue_latency(&r.q, &l);
+
+        uint64_t records = (uint64_t) r.rounds * ((r.messages + SIZE_OF_MESSAGE - 1) / SIZE_OF_MESSAGE);
+        if (l.count != records || l.p50 > l.p99 || l.p99 > l.p999 || l.p999 > l.max) {
+            fprintf(stderr, "latency histogram does not add up\n");
+            return 1;
+        }
+
+        printf("%-17s: %luus, %lu records, sojourn p50 = %luns, p99 = %luns, "
+               "p99.9 = %luns, max = %luns\n",
+               names[r.batched], time, l.count, l.p50, l.p99, l.p999, l.max);
+
+        queue_destroy(&r.q);
+    }
+
+    return 0;
+}
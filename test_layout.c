@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+/* Throughput benchmark for the cache line layout of queue_t.
+ *
+ * Build it twice, once as is and once with -DQUEUE_PACKED_LAYOUT, and run both
+ * binaries with the same arguments (see cnt_layout.sh). Any header with the
+ * queue_put / queue_get interface of queue_msg.h can be measured by passing
+ * -DQUEUE_HEADER='"queue_spsc.h"'.
+ */
+#ifndef QUEUE_HEADER
+#define QUEUE_HEADER "queue_msg.h"
+#endif
+#include QUEUE_HEADER
+
+#define BUFFER_SIZE (getpagesize())
+#define ROUNDS 64
+
+typedef struct {
+    queue_t q;
+    size_t msg_size;
+    int producer_cpu, consumer_cpu;
+} rbuf_t;
+
+size_t in[65536];
+size_t out[65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t msgs = 65536 / r->msg_size;
+    for (int round = 0; round < ROUNDS; round++) {
+        uint8_t *publisher_ptr = (uint8_t *) in;
+        for (size_t i = 0; i < msgs; i++)
+            queue_put(&r->q, &publisher_ptr, sizeof(size_t) * r->msg_size);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t msgs = 65536 / r->msg_size;
+    for (int round = 0; round < ROUNDS; round++) {
+        uint8_t *consumer_ptr = (uint8_t *) out;
+        for (size_t i = 0; i < msgs; i++)
+            queue_get(&r->q, &consumer_ptr, sizeof(size_t) * r->msg_size);
+    }
+    return NULL;
+}
+
+/* Start *fn* on *cpu*, or unpinned if the machine doesn't have that cpu */
+static void start_pinned(pthread_t *th, int cpu, void *(*fn)(void *), rbuf_t *r)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu < sysconf(_SC_NPROCESSORS_ONLN)) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    } else {
+        fprintf(stderr, "cpu %d not available, running unpinned\n", cpu);
+    }
+    pthread_create(th, &attr, fn, (void *) r);
+    pthread_attr_destroy(&attr);
+}
+
+int main(int argc, char *argv[])
+{
+    rbuf_t r;
+    size_t buffer_size = BUFFER_SIZE;
+    r.msg_size = 1;
+    r.producer_cpu = 0;
+    r.consumer_cpu = 1;
+
+    /* 'b' prefixes the buffer size, 'm' the message size in size_t units,
+     * 'p' and 'c' the cpus the producer and the consumer are pinned to.
+     */
+    for (int arg = 1; arg < argc; arg++) {
+        switch (argv[arg][0]) {
+        case 'b': buffer_size = (size_t) atoi(argv[arg] + 1); break;
+        case 'm': r.msg_size = (size_t) atoi(argv[arg] + 1); break;
+        case 'p': r.producer_cpu = atoi(argv[arg] + 1); break;
+        case 'c': r.consumer_cpu = atoi(argv[arg] + 1); break;
+        }
+    }
+    if (r.msg_size == 0 || r.msg_size > 65536)
+        r.msg_size = 1;
+
+    for (size_t i = 0; i < 65536ULL; i++)
+        in[i] = i;
+
+    queue_init(&r.q, buffer_size);
+
+    uint64_t start = get_time();
+
+    pthread_t publisher_th, consumer_th;
+    start_pinned(&publisher_th, r.producer_cpu, &publisher_loop, &r);
+    start_pinned(&consumer_th, r.consumer_cpu, &consumer_loop, &r);
+    pthread_join(publisher_th, NULL);
+    pthread_join(consumer_th, NULL);
+
+    uint64_t end = get_time();
+
+    double bytes = (double) ROUNDS * (65536 / r.msg_size) * r.msg_size * sizeof(size_t);
+#ifdef QUEUE_PACKED_LAYOUT
+    printf("packed layout, ");
+#else
+    printf("partitioned layout, ");
+#endif
+    printf("sizeof(queue_t) = %zu, message = %zu bytes: %.1f MB/s, %.1f Mmsg/s\n",
+           sizeof(queue_t), r.msg_size * sizeof(size_t),
+           bytes / (end - start), ROUNDS * (65536.0 / r.msg_size) / (end - start));
+
+    queue_destroy(&r.q);
+
+    return 0;
+}
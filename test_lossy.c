@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_lossy.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define NUM_THREADS (2)
+#define MAX_THREADS (16)
+#define ROUNDS (20)
+#define MAX_WORDS (32)
+
+/* One producer sends a stream of records of 1 to MAX_WORDS size_t's, all
+ * holding the record's number, without ever waiting for the consumers. Each
+ * consumer spins for a while after every record to fall behind, and checks
+ * that what it gets is whole, in order, and that the records it got plus the
+ * ones it lost add up to the ones sent.
+ */
+
+typedef struct {
+    queue_t q;
+    uint32_t records;
+    uint32_t num_consumers;
+    uint32_t work;
+} rbuf_t;
+
+typedef struct {
+    rbuf_t *r;
+    uint32_t id;
+    uint32_t received;
+    int failed;
+} thread_arg_t;
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t in[MAX_WORDS];
+    for (size_t i = 0; i < r->records; i++) {
+        size_t words = 1 + i % MAX_WORDS;
+        uint8_t *publisher_ptr = (uint8_t *) in;
+        for (size_t w = 0; w < words; w++)
+            in[w] = i;
+        queue_put(&r->q, &publisher_ptr, sizeof(size_t) * words);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    thread_arg_t *t = (thread_arg_t *) arg;
+    rbuf_t *r = t->r;
+    size_t out[MAX_WORDS];
+    size_t last = (size_t) -1;
+    do {
+        uint8_t *consumer_ptr = (uint8_t *) out;
+        size_t len = queue_get(&r->q, t->id, &consumer_ptr, sizeof(out));
+        size_t words = 1 + out[0] % MAX_WORDS;
+        if (len != sizeof(size_t) * words || out[0] + 1 <= last + 1)
+            t->failed = 1;
+        for (size_t w = 1; w < len / sizeof(size_t); w++)
+            if (out[w] != out[0])
+                t->failed = 1;
+        last = out[0];
+        t->received++;
+        for (volatile uint32_t w = 0; w < r->work; w++)
+            ;
+    } while (last != r->records - 1 && !t->failed);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    rbuf_t r;
+    r.records = 1U << 20;
+    r.num_consumers = NUM_THREADS;
+    r.work = 200;
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'm' prefixes the number of records, 'b' the buffer size, 'c' the number
+     * of consumer threads and 'w' the spins a consumer does per record.
+     */
+    for (int arg = 1; arg < argc; arg++) {
+        switch (argv[arg][0]) {
+        case 'm': r.records = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'b': buffer_size = (size_t) atoi(argv[arg] + 1); break;
+        case 'c': r.num_consumers = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'w': r.work = (uint32_t) atoi(argv[arg] + 1); break;
+        }
+    }
+    if (r.records < 1)
+        r.records = 1;
+    if (r.num_consumers < 1 || r.num_consumers > MAX_THREADS)
+        r.num_consumers = NUM_THREADS;
+
+    uint64_t total = 0, overwritten = 0, received = 0, lost = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        queue_init(&r.q, buffer_size, r.num_consumers);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th[MAX_THREADS];
+        thread_arg_t consumer_arg[MAX_THREADS];
+
+        pthread_create(&publisher_th, NULL, &publisher_loop, &r);
+        for (uint32_t t = 0; t < r.num_consumers; t++) {
+            consumer_arg[t] = (thread_arg_t) { &r, t, 0, 0 };
+            pthread_create(&consumer_th[t], NULL, &consumer_loop, &consumer_arg[t]);
+        }
+
+        pthread_join(publisher_th, NULL);
+        for (uint32_t t = 0; t < r.num_consumers; t++)
+            pthread_join(consumer_th[t], NULL);
+
+        total += get_time() - start;
+
+        for (uint32_t t = 0; t < r.num_consumers; t++) {
+            if (consumer_arg[t].failed) {
+                fprintf(stderr, "consumer %u received a torn or out of order record\n", t);
+                return 1;
+            }
+            if (consumer_arg[t].received + queue_lost(&r.q, t) != r.records) {
+                fprintf(stderr, "consumer %u received %u and lost %lu of %u records\n", t,
+                        consumer_arg[t].received, queue_lost(&r.q, t), r.records);
+                return 1;
+            }
+            received += consumer_arg[t].received;
+            lost += queue_lost(&r.q, t);
+        }
+        overwritten += r.q.overwritten;
+
+        queue_destroy(&r.q);
+    }
+
+    printf("consumers = %u: average run time = %luus, per round %lu overwritten, "
+           "%lu received and %lu lost per consumer\n",
+           r.num_consumers, total / ROUNDS, overwritten / ROUNDS,
+           received / ROUNDS / r.num_consumers, lost / ROUNDS / r.num_consumers);
+
+    return 0;
+}
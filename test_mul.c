@@ -1,4 +1,5 @@
-#include <stdio.h>                         
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <unistd.h>
 #include <time.h>
 #include <string.h>
@@ -7,10 +8,11 @@
 
 #define BUFFER_SIZE (getpagesize())
 #define NUM_THREADS (2)
-#define MESSAGES_PER_THREAD (getpagesize() * 2)
+#define MAX_THREADS (64)
+#define ROUNDS (100)
 #define SIZE_OF_MESSAGE 500ULL
 
-uint32_t comp(const void *elem1, const void *elem2)
+int comp(const void *elem1, const void *elem2)
 {
     uint32_t f = *((uint32_t *) elem1);
     uint32_t s = *((uint32_t *) elem2);
@@ -23,11 +25,15 @@ uint32_t comp(const void *elem1, const void *elem2)
 
 typedef struct {
     queue_t q;
-    uint32_t messages_per_thread;
-    uint32_t num_threads;
-    pthread_barrier_t barrier;
+    uint32_t messages;
+    uint32_t num_producers, num_consumers;
 } rbuf_t;
 
+typedef struct {
+    rbuf_t *r;
+    uint32_t id;
+} thread_arg_t;
+
 size_t in[65536];
 size_t out[65536];
 
@@ -42,185 +48,120 @@ uint64_t get_time()
     return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
 }
 
-void rbuf_init(rbuf_t *r)
-{
-    if (pthread_barrier_init(&r->barrier, NULL, (NUM_THREADS + 1)) != 0)
-        fprintf(stderr, "Could not initialize barrier\n");
-    r->num_threads = NUM_THREADS;
-    r->messages_per_thread = 65536U / NUM_THREADS;
-}
-
-void rbuf_destroy(rbuf_t *r)
+/* Number of messages the data is cut into, the last one may be shorter */
+static size_t total_messages(rbuf_t *r)
 {
-    if (pthread_barrier_destroy(&r->barrier) != 0)
-        fprintf(stderr, "Could not destroy barrier\n");
+    return (r->messages + SIZE_OF_MESSAGE - 1) / SIZE_OF_MESSAGE;
 }
 
+/* Producer *id* sends messages id, id + num_producers, ... */
 static void *publisher_loop(void *arg)
 {
-    rbuf_t *r = (rbuf_t *) arg;
-    size_t i;
-    size_t **publisher_ptr = malloc(sizeof(size_t *));
-    *publisher_ptr = in;
-    size_t full_put = (r->messages_per_thread * r->num_threads) / SIZE_OF_MESSAGE;
-    size_t full_get = (r->messages_per_thread) / SIZE_OF_MESSAGE;
-    size_t barrier_put = full_put - r->num_threads * full_get;
-    full_put -= barrier_put;
-    size_t remain_put = (r->messages_per_thread * r->num_threads) % SIZE_OF_MESSAGE;
-    // printf("full_put = %lu\n", full_put);
-    printf("full_put = %lu, barrier_put = %lu, remain_put = %lu\n", full_put, barrier_put, remain_put);
-
-    for (i = 0; i < full_put; i++) {
-        printf("pub %ld time\n", i + 1);
-        queue_put(&r->q, (uint8_t **) publisher_ptr, sizeof(size_t) * SIZE_OF_MESSAGE);
-    }
-    pthread_barrier_wait(&r->barrier);
-    printf("\nrelease barrier from publisher...\n\n");
-    printf("full_put = %lu, barrier_put = %lu, remain_put = %lu\n", full_put, barrier_put, remain_put);
-    for (i = 0; i < barrier_put; i++) {
-        printf("pub %ld time\n", i + full_put + 1);
-        queue_put(&r->q, (uint8_t **) publisher_ptr, sizeof(size_t) * SIZE_OF_MESSAGE);
+    thread_arg_t *t = (thread_arg_t *) arg;
+    rbuf_t *r = t->r;
+    size_t i, sent = 0;
+    for (i = t->id; i < total_messages(r); i += r->num_producers) {
+        uint8_t *publisher_ptr = (uint8_t *) &in[i * SIZE_OF_MESSAGE];
+        size_t len = r->messages - i * SIZE_OF_MESSAGE;
+        if (len > SIZE_OF_MESSAGE)
+            len = SIZE_OF_MESSAGE;
+        queue_put(&r->q, &publisher_ptr, sizeof(size_t) * len);
+        sent++;
     }
-    printf("pub %ld time\n", full_put + barrier_put + 1);
-    // pthread_mutex_unlock(&r->barrier);
-    
-    if(remain_put)
-        queue_put(&r->q, (uint8_t **) publisher_ptr, sizeof(size_t) * remain_put);
-    // pthread_mutex_unlock(&r->barrier);
-    printf("publisher finished\n");
-    return (void *) (i * SIZE_OF_MESSAGE + remain_put);
+    return (void *) sent;
 }
 
+/* Consumers split the messages evenly. Messages arrive in any order, so each
+ * one is stored at the index given by its first value.
+ */
 static void *consumer_loop(void *arg)
 {
-    rbuf_t *r = (rbuf_t *) arg;
-    size_t i;
-    // size_t **consumer_ptr = malloc(sizeof(size_t *));
-    // *consumer_ptr = out;
-    size_t full_get = (r->messages_per_thread) / SIZE_OF_MESSAGE;
-    size_t remain_get = (r->messages_per_thread) % SIZE_OF_MESSAGE;
-    printf("full_get = %lu, remain_get = %lu\n", full_get, remain_get);
-    for (i = 0; i < full_get; i++) {
-        printf("con %ld time\n", i + 1);
-        queue_get(&r->q, (uint8_t **) r->q.consumer_ptr, sizeof(size_t) * SIZE_OF_MESSAGE);
+    thread_arg_t *t = (thread_arg_t *) arg;
+    rbuf_t *r = t->r;
+    size_t msg[SIZE_OF_MESSAGE];
+    size_t i, share = total_messages(r) / r->num_consumers;
+    if (t->id < total_messages(r) % r->num_consumers)
+        share++;
+    for (i = 0; i < share; i++) {
+        uint8_t *consumer_ptr = (uint8_t *) msg;
+        size_t len = queue_get(&r->q, &consumer_ptr, sizeof(msg));
+        memcpy(&out[msg[0]], msg, len);
     }
-    pthread_barrier_wait(&r->barrier);
-    printf("\nrelease barrier from consumer...\n\n");
-    printf("con %ld time\n", full_get + 1);
-    printf("full_get = %lu, remain_get = %lu\n", full_get, remain_get);
-    if(remain_get)
-        queue_get(&r->q, (uint8_t **) r->q.consumer_ptr, sizeof(size_t) * remain_get);
-
-    printf("consumer finished\n");
-
-    return (void *) (i * SIZE_OF_MESSAGE + remain_get);
+    return (void *) i;
 }
 
 int main(int argc, char *argv[])
 {
-    // uint32_t time[100];
-    // uint32_t p_avg = 0, c_avg = 0;
-    // for (int i = 0; i < 100; i++) {
-    for (size_t i = 0; i < 65536ULL; i++) {
-        in[i] = i;
-        out[i] = 0ULL;
-    }
-
+    uint32_t time[ROUNDS];
     rbuf_t r;
-    rbuf_init(&r);
+    r.messages = 65536U;
+    r.num_producers = 1;
+    r.num_consumers = NUM_THREADS;
     size_t buffer_size = BUFFER_SIZE;
-    size_t message_size = 500UL;
 
-    /* In order to customize messages per thread and the buffer size, 
-     * we use argv to recieve arguments. For specific number of messages, 
-     * add 'm' at the front of the argument, for specific buffer size, add 
-     * 'b' at the front of the argument.
+    /* 'm' prefixes the number of messages, 'b' the buffer size, 'p' the number
+     * of producer threads and 'c' the number of consumer threads.
      */
-    if (argc > 2) {
-        if (argv[1][0] == 'm') {
-            r.messages_per_thread = (uint32_t) atoi(argv[1] + 1);
-            buffer_size = (uint64_t) atoi(argv[2] + 1);
-        }
-        if (argv[1][0] == 'b') {
-            buffer_size = (uint64_t) atoi(argv[1] + 1);
-            r.messages_per_thread = (uint32_t) atoi(argv[2] + 1);
+    for (int arg = 1; arg < argc; arg++) {
+        switch (argv[arg][0]) {
+        case 'm': r.messages = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'b': buffer_size = (size_t) atoi(argv[arg] + 1); break;
+        case 'p': r.num_producers = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'c': r.num_consumers = (uint32_t) atoi(argv[arg] + 1); break;
         }
     }
+    if (r.messages > 65536U)
+        r.messages = 65536U;
+    if (r.num_producers < 1 || r.num_producers > MAX_THREADS)
+        r.num_producers = 1;
+    if (r.num_consumers < 1 || r.num_consumers > MAX_THREADS)
+        r.num_consumers = NUM_THREADS;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        for (size_t i = 0; i < 65536ULL; i++) {
+            in[i] = i;
+            out[i] = 0ULL;
+        }
 
-    if (argc > 1) {
-        if (argv[1][0] == 'm')
-            r.messages_per_thread = (uint32_t) atoi(argv[1] + 1);
-        if (argv[1][0] == 'b')
-            buffer_size = (uint64_t) atoi(argv[1] + 1);
-    }
-        
-    queue_init(&r.q, buffer_size, message_size);
-
-    printf("r.message_per_thread is %u\n", r.messages_per_thread);
-    printf("buffer_size is %lu\n", r.q.size);
-    
-    *(r.q.consumer_ptr) = out;
-
-        // uint64_t start = get_time();
-
-    pthread_t publisher_th;
-    pthread_t consumer_th[NUM_THREADS];
-
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-
-        // printf("Starting publisher thread...\n");
-
-    pthread_create(&publisher_th, &attr, &publisher_loop, (void *) &r);
-
-        // printf("Starting consumer thread...\n");
-
-    for(intptr_t i = 0; i < NUM_THREADS; i++)
-        pthread_create(&consumer_th[i], &attr, &consumer_loop, (void *) &r);
-
-    intptr_t sent;
-    pthread_join(publisher_th, (void **) &sent);
-
-    intptr_t recd[NUM_THREADS];
-    for(intptr_t i = 0; i < NUM_THREADS; i++)
-        pthread_join(consumer_th[i], (void **) &recd[i]);
+        queue_init(&r.q, buffer_size, SIZE_OF_MESSAGE);
 
-        // uint64_t end = get_time();
-        // time[i] = end - start;
+        uint64_t start = get_time();
 
-        // p_avg += r.q.p_times;
-        // c_avg += r.q.c_times;
+        pthread_t publisher_th[MAX_THREADS], consumer_th[MAX_THREADS];
+        thread_arg_t publisher_arg[MAX_THREADS], consumer_arg[MAX_THREADS];
 
-        // for(size_t i = 0ULL; i < r.messages_per_thread; i++)
-        //     printf("%lu\n", out[i]);
+        for (uint32_t t = 0; t < r.num_producers; t++) {
+            publisher_arg[t] = (thread_arg_t) { &r, t };
+            pthread_create(&publisher_th[t], NULL, &publisher_loop, &publisher_arg[t]);
+        }
+        for (uint32_t t = 0; t < r.num_consumers; t++) {
+            consumer_arg[t] = (thread_arg_t) { &r, t };
+            pthread_create(&consumer_th[t], NULL, &consumer_loop, &consumer_arg[t]);
+        }
 
-        // printf("\npublisher sent %ld messages\n", sent);
-        // printf("consumer received %ld messages\n", recd);
+        for (uint32_t t = 0; t < r.num_producers; t++)
+            pthread_join(publisher_th[t], NULL);
+        for (uint32_t t = 0; t < r.num_consumers; t++)
+            pthread_join(consumer_th[t], NULL);
 
-    pthread_attr_destroy(&attr);
+        time[i] = get_time() - start;
 
-    queue_destroy(&r.q);
-    rbuf_destroy(&r);
-    // }
-    
-    // for(size_t i = 0; i < r.messages_per_thread; i++)
-    //     printf("%ld\n", out[i]);
+        if (memcmp(in, out, r.messages * sizeof(size_t)) != 0) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            return 1;
+        }
 
-    // for(size_t i = 0; i < 65536U; i++)
-    //     printf("%ld\n", out[i]);
+        queue_destroy(&r.q);
+    }
 
-    // qsort(time, 100U, sizeof(uint32_t), comp);
-    // long long avg = 0LL;
-    // for (int num = 16; num < 84; num++) {
-    //     avg += time[num];
-    // }
-    // avg /= 68;
-    // // printf("average time : %lldus\n", avg);
-    // // printf("With message size %llu, ", SIZE_OF_MESSAGE);
-    // printf("average run time = %lldus\n", avg);
-    // printf("%lld\n", avg);
-    // printf("Average p : %u times\n", p_avg/100);
-    // printf("Average c : %u times\n", c_avg/100);
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    long long avg = 0LL;
+    for (int num = 16; num < 84; num++) {
+        avg += time[num];
+    }
+    avg /= 68;
+    printf("producers = %u, consumers = %u: average run time = %lldus\n",
+           r.num_producers, r.num_consumers, avg);
 
     return 0;
-}
\ No newline at end of file
+}
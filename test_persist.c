@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include <sys/wait.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize() * 16)
+#define QUEUE_PATH "/tmp/test_persist.queue"
+#define RECORD_SIZE 256
+#define PUT 200
+#define GOT 50
+#define ROUNDS 2000
+
+/* A child process opens a persistent QUEUE_FRAMED queue, puts PUT records,
+ * takes GOT of them out again and gets killed. The parent then opens the file
+ * again and checks that exactly the other PUT - GOT records come back out.
+ *
+ * Afterwards the cost of a put and get pair is measured with and without
+ * QUEUE_SYNC.
+ */
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void put_record(queue_t *q, size_t i)
+{
+    uint8_t rec[RECORD_SIZE];
+    uint8_t *publisher_ptr = rec;
+    size_t len = sizeof(size_t) + 1 + i % (RECORD_SIZE - sizeof(size_t) - 1);
+    memset(rec, (int) i, len);
+    memcpy(rec, &i, sizeof(size_t));
+    queue_put(q, &publisher_ptr, len);
+}
+
+/* Returns the sequence number of the record taken out, or -1 if it is broken */
+static long get_record(queue_t *q)
+{
+    uint8_t rec[RECORD_SIZE];
+    uint8_t *consumer_ptr = rec;
+    size_t i, len = queue_get(q, &consumer_ptr, sizeof(rec));
+    memcpy(&i, rec, sizeof(size_t));
+    if (len != sizeof(size_t) + 1 + i % (RECORD_SIZE - sizeof(size_t) - 1) ||
+        rec[len - 1] != (uint8_t) i)
+        return -1;
+    return (long) i;
+}
+
+static void crash_test(const char *path)
+{
+    queue_t q;
+    pid_t pid;
+    size_t recovered = 0;
+
+    unlink(path);
+
+    if ((pid = fork()) == -1)
+        queue_error_errno("Could not fork");
+    if (pid == 0) {
+        queue_open(&q, path, BUFFER_SIZE, QUEUE_FRAMED);
+        for (size_t i = 0; i < PUT; i++)
+            put_record(&q, i);
+        for (size_t i = 0; i < GOT; i++)
+            get_record(&q);
+        kill(getpid(), SIGKILL);
+    }
+    waitpid(pid, NULL, 0);
+
+    queue_open(&q, path, BUFFER_SIZE, QUEUE_FRAMED);
+    while (q.ctl->head != q.ctl->tail) {
+        if (get_record(&q) != (long) (GOT + recovered)) {
+            fprintf(stderr, "record %zu did not survive the crash\n", GOT + recovered);
+            exit(1);
+        }
+        recovered++;
+    }
+    queue_destroy(&q);
+
+    if (recovered != PUT - GOT) {
+        fprintf(stderr, "recovered %zu records instead of %d\n", recovered, PUT - GOT);
+        exit(1);
+    }
+    printf("recovered %zu of %d records after the crash\n", recovered, PUT);
+}
+
+static double run(const char *path, unsigned int flags)
+{
+    queue_t q;
+
+    unlink(path);
+    queue_open(&q, path, BUFFER_SIZE, QUEUE_FRAMED | flags);
+
+    uint64_t start = get_time();
+    for (size_t i = 0; i < ROUNDS; i++) {
+        put_record(&q, i);
+        if (get_record(&q) != (long) i) {
+            fprintf(stderr, "received records do not match the sent ones\n");
+            exit(1);
+        }
+    }
+    uint64_t end = get_time();
+
+    queue_destroy(&q);
+    return (double) (end - start) / ROUNDS;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = QUEUE_PATH;
+
+    /* 'f' prefixes the path of the queue file */
+    for (int arg = 1; arg < argc; arg++)
+        if (argv[arg][0] == 'f')
+            path = argv[arg] + 1;
+
+    crash_test(path);
+
+    printf("put + get            : %.2fus\n", run(path, 0));
+    printf("put + get, QUEUE_SYNC: %.2fus\n", run(path, QUEUE_SYNC));
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (256UL << 20)
+#define BURSTS 3
+#define BURST_SIZE (128UL << 20)
+#define SIZE_OF_MESSAGE (64UL << 10)
+
+/* Send BURSTS bursts of BURST_SIZE bytes through a large ring, with idle
+ * gaps in between, and report how much memory backs the ring right after a
+ * burst was consumed and after the gap, once without and once with
+ * QUEUE_RECLAIM. The idle gap must give the memory back with QUEUE_RECLAIM
+ * and only then, and every message must arrive intact.
+ *
+ * Before that, queue_reclaim is called by hand on a ring that still holds
+ * partly consumed messages, at a range of head and tail positions, and the
+ * messages must come out intact after the producer has refilled the pages it
+ * released.
+ */
+
+typedef struct {
+    queue_t q;
+    size_t busy[BURSTS], idle[BURSTS];
+    int error;
+} rbuf_t;
+
+uint8_t in[SIZE_OF_MESSAGE];
+uint8_t out[SIZE_OF_MESSAGE];
+
+/* Message *i* is in[] with its number in the first bytes */
+static void fill(size_t i)
+{
+    memcpy(in, &i, sizeof(i));
+}
+
+static int check(size_t i)
+{
+    return memcmp(out, &i, sizeof(i)) == 0 &&
+           memcmp(out + sizeof(i), in + sizeof(i), SIZE_OF_MESSAGE - sizeof(i)) == 0;
+}
+
+/* Bytes of memory the memfd holds right now */
+static size_t allocated(queue_t *q)
+{
+    struct stat st;
+    if (fstat(q->fd, &st) != 0)
+        return 0;
+    return (size_t) st.st_blocks * 512;
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (int b = 0; b < BURSTS; b++) {
+        for (size_t i = 0; i < BURST_SIZE / SIZE_OF_MESSAGE; i++) {
+            uint8_t *publisher_ptr = in;
+            fill(b * (BURST_SIZE / SIZE_OF_MESSAGE) + i);
+            queue_put(&r->q, &publisher_ptr, SIZE_OF_MESSAGE);
+        }
+
+        // Wait for the consumer to catch up, then stay quiet for a while
+        while (__atomic_load_n(&r->q.ctl->head, __ATOMIC_ACQUIRE) != r->q.ctl->tail)
+            usleep(1000);
+        r->busy[b] = allocated(&r->q);
+        usleep(QUEUE_RECLAIM_IDLE_NS / 1000 * 3);
+        r->idle[b] = allocated(&r->q);
+    }
+
+    // One last message lets the consumer go
+    uint8_t *publisher_ptr = in;
+    fill(BURSTS * BURST_SIZE / SIZE_OF_MESSAGE);
+    queue_put(&r->q, &publisher_ptr, SIZE_OF_MESSAGE);
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i <= BURSTS * BURST_SIZE / SIZE_OF_MESSAGE; i++) {
+        uint8_t *consumer_ptr = out;
+        queue_get(&r->q, &consumer_ptr, SIZE_OF_MESSAGE);
+        if (!check(i))
+            r->error = 1;
+    }
+    return NULL;
+}
+
+/* Fill a small ring up to *pending* messages after *consumed* went through,
+ * take out half of one, reclaim, refill and drain it, checking every message
+ */
+static void check_reclaim(size_t consumed, size_t pending)
+{
+    queue_t q;
+    const uint8_t *view;
+    size_t put = 0, got = 0, released;
+
+    queue_init(&q, 16 * SIZE_OF_MESSAGE);
+
+    for (; put < consumed + pending; put++) {
+        uint8_t *publisher_ptr = in;
+        if (put - got == 16) {
+            uint8_t *consumer_ptr = out;
+            queue_get(&q, &consumer_ptr, SIZE_OF_MESSAGE);
+            got++;
+        }
+        fill(put);
+        queue_put(&q, &publisher_ptr, SIZE_OF_MESSAGE);
+    }
+    for (; got < consumed; got++) {
+        uint8_t *consumer_ptr = out;
+        queue_get(&q, &consumer_ptr, SIZE_OF_MESSAGE);
+    }
+
+    // Leave the head in the middle of a message
+    queue_peek(&q, &view, SIZE_OF_MESSAGE / 2, SIZE_OF_MESSAGE / 2);
+    memcpy(out, view, SIZE_OF_MESSAGE / 2);
+    queue_release(&q, SIZE_OF_MESSAGE / 2);
+
+    released = queue_reclaim(&q);
+    if (pending < 15 && released == 0) {
+        fprintf(stderr, "queue_reclaim released nothing with %lu messages pending\n", pending);
+        exit(1);
+    }
+
+    // Refill the released pages, then drain everything
+    for (; put < got + 16; put++) {
+        uint8_t *publisher_ptr = in;
+        fill(put);
+        queue_put(&q, &publisher_ptr, SIZE_OF_MESSAGE);
+    }
+    queue_peek(&q, &view, SIZE_OF_MESSAGE / 2, SIZE_OF_MESSAGE / 2);
+    memcpy(out + SIZE_OF_MESSAGE / 2, view, SIZE_OF_MESSAGE / 2);
+    queue_release(&q, SIZE_OF_MESSAGE / 2);
+    for (;;) {
+        if (!check(got)) {
+            fprintf(stderr, "message %lu is corrupt after queue_reclaim\n", got);
+            exit(1);
+        }
+        if (++got == put)
+            break;
+        uint8_t *consumer_ptr = out;
+        queue_get(&q, &consumer_ptr, SIZE_OF_MESSAGE);
+    }
+
+    queue_destroy(&q);
+}
+
+static void run(unsigned int flags)
+{
+    rbuf_t r;
+    r.error = 0;
+
+    queue_init_flags(&r.q, BUFFER_SIZE, flags);
+
+    pthread_t publisher_th, consumer_th;
+    pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+    pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+    pthread_join(publisher_th, NULL);
+    pthread_join(consumer_th, NULL);
+
+    if (r.error) {
+        fprintf(stderr, "received messages do not match the sent ones\n");
+        exit(1);
+    }
+
+    for (int b = 0; b < BURSTS; b++) {
+        printf("%-13s burst %d: %4lu MB after the burst, %4lu MB after the idle gap\n",
+               flags & QUEUE_RECLAIM ? "QUEUE_RECLAIM" : "default", b, r.busy[b] >> 20,
+               r.idle[b] >> 20);
+        if ((flags & QUEUE_RECLAIM) ? r.idle[b] > r.busy[b] / 2 : r.idle[b] < r.busy[b]) {
+            fprintf(stderr, "the idle gap %s the memory\n",
+                    flags & QUEUE_RECLAIM ? "did not release" : "released");
+            exit(1);
+        }
+    }
+
+    queue_destroy(&r.q);
+}
+
+int main(int argc, char *argv[])
+{
+    for (size_t j = 0; j < sizeof(in); j++)
+        in[j] = (uint8_t) (j * 7 + 3);
+
+    for (size_t consumed = 0; consumed < 40; consumed += 3)
+        for (size_t pending = 1; pending <= 16; pending += 5)
+            check_reclaim(consumed, pending);
+    printf("queue_reclaim with pending messages: ok\n");
+
+    run(0);
+    run(QUEUE_RECLAIM);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define SMALL_SIZE (getpagesize() * 4)
+#define LARGE_SIZE (getpagesize() * 256)
+#define RECORDS 200000
+#define MIN_RECORD 16
+#define MAX_RECORD 8192
+#define BATCH 8
+
+/* Stream RECORDS records of mixed sizes through a QUEUE_FRAMED queue while a
+ * third thread keeps switching the ring between SMALL_SIZE and LARGE_SIZE
+ * with queue_resize, and compare with rings that stay at either size. The
+ * last run has the producer put BATCH records at a time with queue_putv,
+ * whose batches may be sized for the large ring just before it shrinks.
+ */
+
+typedef struct {
+    queue_t q;
+    int resize;
+    int vectored;
+    int done;
+    int error;
+    uint32_t resizes, refused;
+} rbuf_t;
+
+size_t lengths[RECORDS];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Record *i* is lengths[i] bytes of (i + j) & 0xff */
+static int check(const uint8_t *rec, size_t len, size_t i)
+{
+    return len == lengths[i] && rec[0] == (uint8_t) i &&
+           rec[len - 1] == (uint8_t) (i + len - 1);
+}
+
+static uint8_t records[BATCH][MAX_RECORD];
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    if (r->vectored) {
+        for (size_t i = 0; i < RECORDS; i += BATCH) {
+            struct iovec iov[BATCH];
+            int n = RECORDS - i < BATCH ? RECORDS - i : BATCH;
+            for (int k = 0; k < n; k++) {
+                for (size_t j = 0; j < lengths[i + k]; j++)
+                    records[k][j] = (uint8_t) (i + k + j);
+                iov[k] = (struct iovec) { records[k], lengths[i + k] };
+            }
+            queue_putv(&r->q, iov, n);
+        }
+        return NULL;
+    }
+    for (size_t i = 0; i < RECORDS; i++) {
+        uint8_t *rec = queue_reserve(&r->q, lengths[i]);
+        for (size_t j = 0; j < lengths[i]; j++)
+            rec[j] = (uint8_t) (i + j);
+        queue_commit(&r->q, lengths[i]);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    uint8_t rec[MAX_RECORD];
+    for (size_t i = 0; i < RECORDS; i++) {
+        uint8_t *consumer_ptr = rec;
+        size_t len = queue_get(&r->q, &consumer_ptr, sizeof(rec));
+        if (!check(rec, len, i))
+            r->error = 1;
+    }
+    __atomic_store_n(&r->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *resizer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    int large = 0;
+    while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+        large = !large;
+        if (queue_resize(&r->q, large ? LARGE_SIZE : SMALL_SIZE) == 0)
+            r->resizes++;
+        else
+            r->refused++;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static void run(const char *name, size_t size, int resize, int vectored)
+{
+    rbuf_t r;
+    r.resize = resize;
+    r.vectored = vectored;
+    r.done = r.error = 0;
+    r.resizes = r.refused = 0;
+
+    queue_init_flags(&r.q, size, QUEUE_FRAMED);
+
+    uint64_t start = get_time();
+
+    pthread_t publisher_th, consumer_th, resizer_th;
+    pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+    pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+    if (resize)
+        pthread_create(&resizer_th, NULL, &resizer_loop, (void *) &r);
+    pthread_join(publisher_th, NULL);
+    pthread_join(consumer_th, NULL);
+    if (resize)
+        pthread_join(resizer_th, NULL);
+
+    uint64_t end = get_time();
+
+    if (r.error) {
+        fprintf(stderr, "received records do not match the sent ones\n");
+        exit(1);
+    }
+
+    printf("%-8s: %lluus", name, (unsigned long long) (end - start));
+    if (resize)
+        printf(", %u resizes, %u refused", r.resizes, r.refused);
+    printf("\n");
+
+    queue_destroy(&r.q);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t seed = 1;
+
+    for (size_t i = 0; i < RECORDS; i++) {
+        seed = seed * 1103515245 + 12345;
+        lengths[i] = MIN_RECORD + (seed >> 8) % (MAX_RECORD - MIN_RECORD + 1);
+    }
+
+    run("small", SMALL_SIZE, 0, 0);
+    run("large", LARGE_SIZE, 0, 0);
+    run("resizing", SMALL_SIZE, 1, 0);
+    run("putv", SMALL_SIZE, 1, 1);
+
+    return 0;
+}
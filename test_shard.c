@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_shard.h"
+
+#define BUFFER_SIZE (getpagesize() * 4)
+#define MAX_THREADS (64)
+#define ROUNDS (5)
+#define MESSAGES (1U << 20)
+#define SIZE_OF_MESSAGE 8
+
+/* n producers send MESSAGES messages in total through a sharded queue to n
+ * consumers, for n from 1 up to the number of cpus (or the 'n' argument), and
+ * the throughput is printed for every n. A few runs with more consumers than
+ * producers and the other way round follow.
+ *
+ * A message is the producer number in the top byte and a sequence number
+ * below it. Every consumer checks that the messages of each producer reach it
+ * in order, and every sequence number must be received exactly once. Before
+ * every run each consumer in turn must get a message put into an otherwise
+ * empty queue, whichever shard it is in.
+ */
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_sharded_t sq;
+    uint32_t producers;
+    uint32_t tickets;
+    int error;
+} rbuf_t;
+
+uint8_t seen[MESSAGES];
+
+typedef struct {
+    rbuf_t *r;
+    uint32_t id;
+} thread_arg_t;
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* Producer *id* sends every producers-th message */
+static void *publisher_loop(void *arg)
+{
+    thread_arg_t *t = (thread_arg_t *) arg;
+    rbuf_t *r = t->r;
+    for (uint64_t i = t->id; i < MESSAGES; i += r->producers) {
+        uint64_t msg = ((uint64_t) t->id << 56) | i;
+        uint8_t *publisher_ptr = (uint8_t *) &msg;
+        queue_sharded_put(&r->sq, t->id, &publisher_ptr, SIZE_OF_MESSAGE);
+    }
+    return NULL;
+}
+
+/* Consumers take a ticket per message, so they know when to stop */
+static void *consumer_loop(void *arg)
+{
+    thread_arg_t *t = (thread_arg_t *) arg;
+    rbuf_t *r = t->r;
+    uint64_t last[MAX_THREADS];
+    memset(last, 0xff, sizeof(last));
+
+    while (__atomic_fetch_add(&r->tickets, 1, __ATOMIC_RELAXED) < MESSAGES) {
+        uint64_t msg;
+        uint8_t *consumer_ptr = (uint8_t *) &msg;
+        queue_sharded_get(&r->sq, t->id, &consumer_ptr, sizeof(msg));
+
+        uint32_t p = msg >> 56;
+        uint64_t i = msg & ((1ULL << 56) - 1);
+        if (p >= r->producers || i >= MESSAGES || (last[p] != UINT64_MAX && i <= last[p]))
+            r->error = 1;
+        else
+            __atomic_add_fetch(&seen[i], 1, __ATOMIC_RELAXED);
+        last[p] = i;
+    }
+
+    return NULL;
+}
+
+/* Put one message at a time into an empty queue, from every producer in turn,
+ * and have each consumer in turn get it; a consumer that doesn't look at the
+ * shard it is in blocks forever
+ */
+static void check_progress(uint32_t producers, uint32_t consumers, size_t buffer_size)
+{
+    queue_sharded_t sq;
+    queue_sharded_init(&sq, buffer_size, producers, consumers);
+
+    for (uint32_t n = 0; n < producers * consumers; n++) {
+        uint32_t p = n % producers, c = n / producers;
+        uint64_t in = ((uint64_t) p << 56) | n, out = 0;
+        uint8_t *publisher_ptr = (uint8_t *) &in;
+        uint8_t *consumer_ptr = (uint8_t *) &out;
+
+        queue_sharded_put(&sq, p, &publisher_ptr, SIZE_OF_MESSAGE);
+        queue_sharded_get(&sq, c, &consumer_ptr, sizeof(out));
+        if (out != in) {
+            fprintf(stderr, "consumer %u did not get the message of producer %u\n", c, p);
+            exit(1);
+        }
+    }
+
+    queue_sharded_destroy(&sq);
+}
+
+static double run(uint32_t producers, uint32_t consumers, size_t buffer_size)
+{
+    uint32_t time[ROUNDS];
+
+    check_progress(producers, consumers, buffer_size);
+
+    for (int i = 0; i < ROUNDS; i++) {
+        rbuf_t r;
+        r.producers = producers;
+        r.tickets = 0;
+        r.error = 0;
+        memset(seen, 0, sizeof(seen));
+
+        queue_sharded_init(&r.sq, buffer_size, producers, consumers);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th[MAX_THREADS], consumer_th[MAX_THREADS];
+        thread_arg_t arg[MAX_THREADS];
+
+        for (uint32_t t = 0; t < producers || t < consumers; t++) {
+            arg[t] = (thread_arg_t) { &r, t };
+            if (t < producers)
+                pthread_create(&publisher_th[t], NULL, &publisher_loop, &arg[t]);
+            if (t < consumers)
+                pthread_create(&consumer_th[t], NULL, &consumer_loop, &arg[t]);
+        }
+        for (uint32_t t = 0; t < producers; t++)
+            pthread_join(publisher_th[t], NULL);
+        for (uint32_t t = 0; t < consumers; t++)
+            pthread_join(consumer_th[t], NULL);
+
+        time[i] = get_time() - start;
+
+        for (uint32_t m = 0; m < MESSAGES && !r.error; m++)
+            if (seen[m] != 1)
+                r.error = 1;
+        if (r.error) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            exit(1);
+        }
+
+        queue_sharded_destroy(&r.sq);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    return (double) MESSAGES / time[ROUNDS / 2];
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'n' prefixes the highest number of producers (and consumers), 'b' the
+     * buffer size of every shard
+     */
+    for (int arg = 1; arg < argc; arg++) {
+        if (argv[arg][0] == 'n')
+            max_threads = (uint32_t) atoi(argv[arg] + 1);
+        if (argv[arg][0] == 'b')
+            buffer_size = (size_t) atoi(argv[arg] + 1);
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS)
+        max_threads = 1;
+
+    for (uint32_t n = 1; n <= max_threads; n++)
+        printf("producers = consumers = %u: %.2f Mmsg/s\n", n, run(n, n, buffer_size));
+
+    const uint32_t mixed[][2] = {{1, 2}, {1, 4}, {2, 3}, {2, 1}, {4, 2}, {3, 2}};
+    for (size_t k = 0; k < sizeof(mixed) / sizeof(mixed[0]); k++)
+        printf("producers = %u, consumers = %u: %.2f Mmsg/s\n", mixed[k][0], mixed[k][1],
+               run(mixed[k][0], mixed[k][1], buffer_size));
+
+    return 0;
+}
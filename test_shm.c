@@ -0,0 +1,197 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include <sys/wait.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define ROUNDS 100
+#ifndef SIZE_OF_MESSAGE
+#define SIZE_OF_MESSAGE 100ULL
+#endif
+
+/* Move 65536 size_t's from a parent process to a forked child, once through a
+ * QUEUE_SHARED queue the child attaches to with queue_attach_fd and once
+ * through a pipe, in messages of SIZE_OF_MESSAGE size_t's.
+ *
+ * Every round the child checks what it got and answers with one byte on the
+ * socket, so a round ends when the child has consumed all of it.
+ */
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+size_t in[65536];
+size_t out[65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void publish_queue(queue_t *q, uint32_t messages)
+{
+    uint8_t *publisher_ptr = (uint8_t *) in;
+    for (size_t i = 0; i < messages; i += SIZE_OF_MESSAGE) {
+        size_t len = messages - i < SIZE_OF_MESSAGE ? messages - i : SIZE_OF_MESSAGE;
+        queue_put(q, &publisher_ptr, sizeof(size_t) * len);
+    }
+}
+
+static void consume_queue(queue_t *q, uint32_t messages)
+{
+    uint8_t *consumer_ptr = (uint8_t *) out;
+    for (size_t i = 0; i < messages; i += SIZE_OF_MESSAGE) {
+        size_t len = messages - i < SIZE_OF_MESSAGE ? messages - i : SIZE_OF_MESSAGE;
+        queue_get(q, &consumer_ptr, sizeof(size_t) * len);
+    }
+}
+
+static void publish_pipe(int fd, uint32_t messages)
+{
+    for (size_t i = 0; i < messages; i += SIZE_OF_MESSAGE) {
+        size_t len = messages - i < SIZE_OF_MESSAGE ? messages - i : SIZE_OF_MESSAGE;
+        if (write(fd, &in[i], sizeof(size_t) * len) != (ssize_t) (sizeof(size_t) * len))
+            queue_error_errno("Could not write to pipe");
+    }
+}
+
+static void consume_pipe(int fd, uint32_t messages)
+{
+    uint8_t *consumer_ptr = (uint8_t *) out;
+    size_t left = messages * sizeof(size_t);
+    while (left) {
+        ssize_t n = read(fd, consumer_ptr, left < sizeof(size_t) * SIZE_OF_MESSAGE
+                                               ? left : sizeof(size_t) * SIZE_OF_MESSAGE);
+        if (n <= 0)
+            queue_error_errno("Could not read from pipe");
+        consumer_ptr += n;
+        left -= n;
+    }
+}
+
+/* The child: ROUNDS rounds over the queue, then ROUNDS over the pipe */
+static void child(int sock, int pipe_fd, uint32_t messages)
+{
+    for (int i = 0; i < 2 * ROUNDS; i++) {
+        memset(out, 0, sizeof(out));
+
+        if (i < ROUNDS) {
+            queue_t q;
+            queue_attach_fd(&q, sock);
+            consume_queue(&q, messages);
+            queue_destroy(&q);
+        } else {
+            consume_pipe(pipe_fd, messages);
+        }
+
+        char ok = memcmp(in, out, messages * sizeof(size_t)) == 0;
+        if (write(sock, &ok, 1) != 1)
+            queue_error_errno("Could not answer parent");
+    }
+    exit(0);
+}
+
+static long long run(int use_pipe, int sock, int pipe_fd, uint32_t messages, size_t buffer_size)
+{
+    uint32_t time[ROUNDS];
+    for (int i = 0; i < ROUNDS; i++) {
+        queue_t q;
+        char ok;
+
+        if (!use_pipe) {
+            queue_init_flags(&q, buffer_size, QUEUE_SHARED);
+            queue_export_fd(&q, sock);
+        }
+
+        uint64_t start = get_time();
+
+        if (use_pipe)
+            publish_pipe(pipe_fd, messages);
+        else
+            publish_queue(&q, messages);
+
+        if (read(sock, &ok, 1) != 1)
+            queue_error_errno("Child went away");
+
+        time[i] = get_time() - start;
+
+        if (!ok) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            exit(1);
+        }
+
+        if (!use_pipe)
+            queue_destroy(&q);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    long long avg = 0LL;
+    for (int num = ROUNDS * 16 / 100; num < ROUNDS * 84 / 100; num++)
+        avg += time[num];
+    return avg / (ROUNDS * 84 / 100 - ROUNDS * 16 / 100);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t messages = 65536U;
+    size_t buffer_size = BUFFER_SIZE;
+    int sv[2], pipe_fds[2], status;
+    pid_t pid;
+
+    /* 'm' prefixes the number of size_t's, 'b' the buffer size */
+    for (int arg = 1; arg < argc; arg++) {
+        if (argv[arg][0] == 'm')
+            messages = (uint32_t) atoi(argv[arg] + 1);
+        if (argv[arg][0] == 'b')
+            buffer_size = (size_t) atoi(argv[arg] + 1);
+    }
+    if (messages > 65536U)
+        messages = 65536U;
+
+    for (size_t i = 0; i < 65536ULL; i++)
+        in[i] = i;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 || pipe(pipe_fds) != 0)
+        queue_error_errno("Could not create socket pair or pipe");
+
+    if ((pid = fork()) == -1)
+        queue_error_errno("Could not fork");
+    if (pid == 0) {
+        close(sv[0]);
+        close(pipe_fds[1]);
+        child(sv[1], pipe_fds[0], messages);
+    }
+    close(sv[1]);
+    close(pipe_fds[0]);
+
+    printf("shared queue : average run time = %lldus\n",
+           run(0, sv[0], pipe_fds[1], messages, buffer_size));
+    printf("pipe         : average run time = %lldus\n",
+           run(1, sv[0], pipe_fds[1], messages, buffer_size));
+
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "child failed\n");
+        return 1;
+    }
+
+    return 0;
+}
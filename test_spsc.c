@@ -0,0 +1,145 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize())
+#ifndef SIZE_OF_MESSAGE
+#define SIZE_OF_MESSAGE 100ULL
+#endif
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_t q;
+    uint32_t messages_per_thread;
+    uint32_t num_threads;
+} rbuf_t;
+
+size_t in[65536];
+size_t out[65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t i;
+    uint8_t *publisher_ptr = (uint8_t *) in;
+    size_t full_put = (r->messages_per_thread * r->num_threads) / SIZE_OF_MESSAGE;
+    size_t remain_put = (r->messages_per_thread * r->num_threads) % SIZE_OF_MESSAGE;
+    for (i = 0; i < full_put; i++)
+        queue_put(&r->q, &publisher_ptr, sizeof(size_t) * SIZE_OF_MESSAGE);
+    if (remain_put)
+        queue_put(&r->q, &publisher_ptr, sizeof(size_t) * remain_put);
+    return (void *) (i * SIZE_OF_MESSAGE + remain_put);
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t i;
+    uint8_t *consumer_ptr = (uint8_t *) out;
+    size_t full_get = (r->messages_per_thread) / SIZE_OF_MESSAGE;
+    size_t remain_get = (r->messages_per_thread) % SIZE_OF_MESSAGE;
+    for (i = 0; i < full_get; i++)
+        queue_get(&r->q, &consumer_ptr, sizeof(size_t) * SIZE_OF_MESSAGE);
+    if (remain_get)
+        queue_get(&r->q, &consumer_ptr, sizeof(size_t) * remain_get);
+    return (void *) (i * SIZE_OF_MESSAGE + remain_get);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t time[1000];
+    uint32_t p_avg = 0, c_avg = 0;
+    for (int i = 0; i < 1000; i++) {
+        for (size_t i = 0; i < 65536ULL; i++) {
+            in[i] = i;
+            out[i] = 0ULL;
+        }
+
+        rbuf_t r;
+        r.num_threads = 1U;
+        r.messages_per_thread = 65536U;
+        size_t buffer_size = BUFFER_SIZE;
+
+        /* Same arguments as test_con_*.c: 'm' prefixes the number of
+         * messages, 'b' prefixes the buffer size.
+         */
+        for (int arg = 1; arg < argc; arg++) {
+            if (argv[arg][0] == 'm')
+                r.messages_per_thread = (uint32_t) atoi(argv[arg] + 1);
+            if (argv[arg][0] == 'b')
+                buffer_size = (uint64_t) atoi(argv[arg] + 1);
+        }
+
+        queue_init(&r.q, buffer_size);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th;
+        pthread_t consumer_th;
+
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+
+        pthread_create(&publisher_th, &attr, &publisher_loop, (void *) &r);
+
+        pthread_create(&consumer_th, &attr, &consumer_loop, (void *) &r);
+
+        intptr_t sent;
+        pthread_join(publisher_th, (void **) &sent);
+
+        intptr_t recd;
+        pthread_join(consumer_th, (void **) &recd);
+
+        uint64_t end = get_time();
+        time[i] = end - start;
+
+        p_avg += r.q.ctl->p_times;
+        c_avg += r.q.ctl->c_times;
+
+        if (memcmp(in, out, r.messages_per_thread * sizeof(size_t)) != 0) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            return 1;
+        }
+
+        pthread_attr_destroy(&attr);
+
+        queue_destroy(&r.q);
+    }
+
+    qsort(time, 1000U, sizeof(uint32_t), comp);
+    long long avg = 0LL;
+    for (int num = 160; num < 840; num++) {
+        avg += time[num];
+    }
+    avg /= 680;
+    printf("average run time = %lldus\n", avg);
+    printf("Average p : %u times\n", p_avg/1000);
+    printf("Average c : %u times\n", c_avg/1000);
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define SIZE_OF_MESSAGE 100ULL
+
+/* One producer sends 65536 size_t's 100 times over, in messages of
+ * SIZE_OF_MESSAGE, to a consumer that spins for a while after every message,
+ * while a third thread reads queue_stats every millisecond. Checks that the
+ * counters add up once both sides are done, and prints them. Build with
+ * -DQUEUE_NO_STATS to compare the run time without the counters.
+ */
+
+typedef struct {
+    queue_t q;
+    uint32_t messages;
+    uint32_t rounds;
+    uint32_t work;
+    int done;
+    uint64_t snapshots;
+    size_t max_occupancy;
+} rbuf_t;
+
+size_t in[65536];
+size_t out[65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (uint32_t round = 0; round < r->rounds; round++) {
+        uint8_t *publisher_ptr = (uint8_t *) in;
+        for (size_t i = 0; i < r->messages; i += SIZE_OF_MESSAGE) {
+            size_t len = r->messages - i < SIZE_OF_MESSAGE ? r->messages - i : SIZE_OF_MESSAGE;
+            queue_put(&r->q, &publisher_ptr, sizeof(size_t) * len);
+        }
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (uint32_t round = 0; round < r->rounds; round++) {
+        uint8_t *consumer_ptr = (uint8_t *) out;
+        for (size_t i = 0; i < r->messages; i += SIZE_OF_MESSAGE) {
+            size_t len = r->messages - i < SIZE_OF_MESSAGE ? r->messages - i : SIZE_OF_MESSAGE;
+            queue_get(&r->q, &consumer_ptr, sizeof(size_t) * len);
+            for (volatile uint32_t w = 0; w < r->work; w++)
+                ;
+        }
+    }
+    return NULL;
+}
+
+static void *monitor_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    queue_stats_t s;
+    while (!__atomic_load_n(&r->done, __ATOMIC_ACQUIRE)) {
+        queue_stats(&r->q, &s);
+        if (s.occupancy > r->max_occupancy)
+            r->max_occupancy = s.occupancy;
+        r->snapshots++;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    rbuf_t r;
+    r.messages = 65536U;
+    r.rounds = 100;
+    r.work = 1000;
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'm' prefixes the number of size_t's per round, 'r' the number of
+     * rounds, 'b' the buffer size and 'w' the spins the consumer does per
+     * message.
+     */
+    for (int arg = 1; arg < argc; arg++) {
+        switch (argv[arg][0]) {
+        case 'm': r.messages = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'r': r.rounds = (uint32_t) atoi(argv[arg] + 1); break;
+        case 'b': buffer_size = (size_t) atoi(argv[arg] + 1); break;
+        case 'w': r.work = (uint32_t) atoi(argv[arg] + 1); break;
+        }
+    }
+    if (r.messages > 65536U)
+        r.messages = 65536U;
+
+    for (size_t i = 0; i < 65536ULL; i++)
+        in[i] = i;
+
+    queue_init(&r.q, buffer_size);
+    r.done = 0;
+    r.snapshots = 0;
+    r.max_occupancy = 0;
+
+    uint64_t start = get_time();
+
+    pthread_t publisher_th, consumer_th, monitor_th;
+    pthread_create(&monitor_th, NULL, &monitor_loop, &r);
+    pthread_create(&publisher_th, NULL, &publisher_loop, &r);
+    pthread_create(&consumer_th, NULL, &consumer_loop, &r);
+
+    pthread_join(publisher_th, NULL);
+    pthread_join(consumer_th, NULL);
+
+    uint64_t time = get_time() - start;
+
+    __atomic_store_n(&r.done, 1, __ATOMIC_RELEASE);
+    pthread_join(monitor_th, NULL);
+
+    if (memcmp(in, out, r.messages * sizeof(size_t)) != 0) {
+        fprintf(stderr, "received messages do not match the sent ones\n");
+        return 1;
+    }
+
+    queue_stats_t s;
+    queue_stats(&r.q, &s);
+
+#ifndef QUEUE_NO_STATS
+    uint64_t messages = (uint64_t) r.rounds * ((r.messages + SIZE_OF_MESSAGE - 1) / SIZE_OF_MESSAGE);
+    uint64_t samples = 0;
+    for (int i = 0; i < QUEUE_STATS_BUCKETS; i++)
+        samples += s.histogram[i];
+
+    if (s.messages_in != messages || s.messages_out != messages ||
+        s.bytes_in != (uint64_t) r.rounds * r.messages * sizeof(size_t) ||
+        s.bytes_out != s.bytes_in || s.occupancy != 0 || s.high_water > r.q.size ||
+        samples != messages / QUEUE_STATS_SAMPLE) {
+        fprintf(stderr, "statistics do not add up\n");
+        return 1;
+    }
+#endif
+
+    printf("run time = %luus, %lu snapshots taken while running, highest occupancy %lu\n", time,
+           r.snapshots, r.max_occupancy);
+    printf("in:  %lu messages, %lu bytes, blocked %lu times (%lu asleep) for %luus\n",
+           s.messages_in, s.bytes_in, s.put_blocks, s.put_sleeps, s.put_blocked_ns / 1000);
+    printf("out: %lu messages, %lu bytes, blocked %lu times (%lu asleep) for %luus\n",
+           s.messages_out, s.bytes_out, s.get_blocks, s.get_sleeps, s.get_blocked_ns / 1000);
+    printf("high water = %lu of %lu bytes, occupancy samples:", s.high_water, r.q.size);
+    for (int i = 0; i < QUEUE_STATS_BUCKETS; i++)
+        printf(" %lu", s.histogram[i]);
+    printf("\n");
+
+    queue_destroy(&r.q);
+
+    return 0;
+}
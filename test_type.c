@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+#include "queue_type.h"
+
+#define BUFFER_SIZE (getpagesize() * 16)
+#define MESSAGES (1U << 22)
+#define ROUNDS (5)
+#define BATCH (64)
+
+/* One producer sends MESSAGES fixed-size records to one consumer, once
+ * through the byte-oriented queue_put / queue_get of queue_spsc.h and once
+ * through a ring from QUEUE_DEFINE_TYPED of the same byte size, for 8 and 64
+ * byte records, and one element or BATCH at a time. Prints the median
+ * throughput of each.
+ */
+
+typedef struct {
+    size_t seq;
+    size_t payload[7];
+} record_t;
+
+QUEUE_DEFINE_TYPED(ring_u64, size_t, 13)
+QUEUE_DEFINE_TYPED(ring_rec, record_t, 10)
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_t q;
+    ring_u64_t *u64;
+    ring_rec_t *rec;
+    int error;
+} rbuf_t;
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *spsc_u64_publisher(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < MESSAGES; i++) {
+        uint8_t *publisher_ptr = (uint8_t *) &i;
+        queue_put(&r->q, &publisher_ptr, sizeof(i));
+    }
+    return NULL;
+}
+
+static void *spsc_u64_consumer(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < MESSAGES; i++) {
+        size_t v;
+        uint8_t *consumer_ptr = (uint8_t *) &v;
+        queue_get(&r->q, &consumer_ptr, sizeof(v));
+        if (v != i)
+            r->error = 1;
+    }
+    return NULL;
+}
+
+static void *typed_u64_publisher(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < MESSAGES; i++)
+        ring_u64_put(r->u64, &i);
+    return NULL;
+}
+
+static void *typed_u64_consumer(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < MESSAGES; i++) {
+        size_t v;
+        ring_u64_get(r->u64, &v);
+        if (v != i)
+            r->error = 1;
+    }
+    return NULL;
+}
+
+static void *typed_u64_batch_publisher(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t v[BATCH];
+    for (size_t i = 0; i < MESSAGES; i += BATCH) {
+        for (size_t j = 0; j < BATCH; j++)
+            v[j] = i + j;
+        ring_u64_put_n(r->u64, v, BATCH);
+    }
+    return NULL;
+}
+
+static void *typed_u64_batch_consumer(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t v[BATCH];
+    for (size_t i = 0; i < MESSAGES; i += BATCH) {
+        ring_u64_get_n(r->u64, v, BATCH);
+        for (size_t j = 0; j < BATCH; j++)
+            if (v[j] != i + j)
+                r->error = 1;
+    }
+    return NULL;
+}
+
+static void *spsc_rec_publisher(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    record_t rec = {0};
+    for (size_t i = 0; i < MESSAGES; i++) {
+        uint8_t *publisher_ptr = (uint8_t *) &rec;
+        rec.seq = i;
+        queue_put(&r->q, &publisher_ptr, sizeof(rec));
+    }
+    return NULL;
+}
+
+static void *spsc_rec_consumer(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < MESSAGES; i++) {
+        record_t rec;
+        uint8_t *consumer_ptr = (uint8_t *) &rec;
+        queue_get(&r->q, &consumer_ptr, sizeof(rec));
+        if (rec.seq != i)
+            r->error = 1;
+    }
+    return NULL;
+}
+
+static void *typed_rec_publisher(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    record_t rec = {0};
+    for (size_t i = 0; i < MESSAGES; i++) {
+        rec.seq = i;
+        ring_rec_put(r->rec, &rec);
+    }
+    return NULL;
+}
+
+static void *typed_rec_consumer(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    for (size_t i = 0; i < MESSAGES; i++) {
+        record_t rec;
+        ring_rec_get(r->rec, &rec);
+        if (rec.seq != i)
+            r->error = 1;
+    }
+    return NULL;
+}
+
+static void run(const char *name, void *(*publisher)(void *), void *(*consumer)(void *))
+{
+    uint32_t time[ROUNDS];
+    rbuf_t r;
+    r.u64 = aligned_alloc(QUEUE_CACHELINE_SIZE, sizeof(ring_u64_t));
+    r.rec = aligned_alloc(QUEUE_CACHELINE_SIZE, sizeof(ring_rec_t));
+
+    for (int i = 0; i < ROUNDS; i++) {
+        r.error = 0;
+        queue_init(&r.q, BUFFER_SIZE);
+        ring_u64_init(r.u64);
+        ring_rec_init(r.rec);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th;
+        pthread_create(&publisher_th, NULL, publisher, &r);
+        pthread_create(&consumer_th, NULL, consumer, &r);
+        pthread_join(publisher_th, NULL);
+        pthread_join(consumer_th, NULL);
+
+        time[i] = get_time() - start;
+
+        if (r.error) {
+            fprintf(stderr, "%s: received messages do not match the sent ones\n", name);
+            exit(1);
+        }
+
+        queue_destroy(&r.q);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    printf("%-16s: %.1f Mmsg/s\n", name, (double) MESSAGES / time[ROUNDS / 2]);
+
+    free(r.u64);
+    free(r.rec);
+}
+
+int main(int argc, char *argv[])
+{
+    run("queue_put 8B", spsc_u64_publisher, spsc_u64_consumer);
+    run("typed 8B", typed_u64_publisher, typed_u64_consumer);
+    run("typed 8B x64", typed_u64_batch_publisher, typed_u64_batch_consumer);
+    run("queue_put 64B", spsc_rec_publisher, spsc_rec_consumer);
+    run("typed 64B", typed_rec_publisher, typed_rec_consumer);
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize())
+#define ROUNDS 100
+#ifndef SIZE_OF_BATCH
+#define SIZE_OF_BATCH 100
+#endif
+
+/* Move 65536 one-size_t messages like test_dyn.c does, once with one
+ * queue_put / queue_get per message and once with SIZE_OF_BATCH messages per
+ * queue_putv / queue_getv call.
+ */
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_t q;
+    uint32_t messages;
+    int vectored;
+} rbuf_t;
+
+size_t in[65536];
+size_t out[65536];
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    struct iovec iov[SIZE_OF_BATCH];
+    uint8_t *publisher_ptr = (uint8_t *) in;
+    size_t i = 0;
+
+    while (i < r->messages) {
+        if (!r->vectored) {
+            queue_put(&r->q, &publisher_ptr, sizeof(size_t));
+            i++;
+            continue;
+        }
+        int n;
+        for (n = 0; n < SIZE_OF_BATCH && i < r->messages; n++, i++)
+            iov[n] = (struct iovec) { &in[i], sizeof(size_t) };
+        queue_putv(&r->q, iov, n);
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    struct iovec iov[SIZE_OF_BATCH];
+    uint8_t *consumer_ptr = (uint8_t *) out;
+    size_t i = 0;
+
+    while (i < r->messages) {
+        if (!r->vectored) {
+            queue_get(&r->q, &consumer_ptr, sizeof(size_t));
+            i++;
+            continue;
+        }
+        int n;
+        for (n = 0; n < SIZE_OF_BATCH && i < r->messages; n++, i++)
+            iov[n] = (struct iovec) { &out[i], sizeof(size_t) };
+        queue_getv(&r->q, iov, n);
+    }
+    return NULL;
+}
+
+static long long run(int vectored, uint32_t messages, size_t buffer_size)
+{
+    uint32_t time[ROUNDS];
+    for (int i = 0; i < ROUNDS; i++) {
+        for (size_t i = 0; i < 65536ULL; i++) {
+            in[i] = i;
+            out[i] = 0ULL;
+        }
+
+        rbuf_t r;
+        r.messages = messages;
+        r.vectored = vectored;
+
+        queue_init(&r.q, buffer_size);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th;
+        pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+        pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+        pthread_join(publisher_th, NULL);
+        pthread_join(consumer_th, NULL);
+
+        time[i] = get_time() - start;
+
+        if (memcmp(in, out, messages * sizeof(size_t)) != 0) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            exit(1);
+        }
+
+        queue_destroy(&r.q);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    long long avg = 0LL;
+    for (int num = ROUNDS * 16 / 100; num < ROUNDS * 84 / 100; num++)
+        avg += time[num];
+    return avg / (ROUNDS * 84 / 100 - ROUNDS * 16 / 100);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t messages = 65536U;
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'm' prefixes the number of messages, 'b' the buffer size */
+    for (int arg = 1; arg < argc; arg++) {
+        if (argv[arg][0] == 'm')
+            messages = (uint32_t) atoi(argv[arg] + 1);
+        if (argv[arg][0] == 'b')
+            buffer_size = (size_t) atoi(argv[arg] + 1);
+    }
+    if (messages > 65536U)
+        messages = 65536U;
+
+    printf("queue_put  / queue_get  : average run time = %lldus\n",
+           run(0, messages, buffer_size));
+    printf("queue_putv / queue_getv : average run time = %lldus\n",
+           run(1, messages, buffer_size));
+
+    return 0;
+}
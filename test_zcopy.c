@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <string.h>
+
+#include "queue_spsc.h"
+
+#define BUFFER_SIZE (getpagesize() * 4)
+#define ROUNDS 100
+#ifndef SIZE_OF_MESSAGE
+#define SIZE_OF_MESSAGE 100ULL
+#endif
+
+/* Compare a producer that serializes its messages into a local buffer and
+ * copies them in with queue_put against one that serializes them straight
+ * into the ring with queue_reserve / queue_commit, and a consumer that copies
+ * every message out with queue_get against one that checks it in place with
+ * queue_peek / queue_release.
+ */
+
+int comp(const void *elem1, const void *elem2)
+{
+    uint32_t f = *((uint32_t *) elem1);
+    uint32_t s = *((uint32_t *) elem2);
+    if (f > s)
+        return 1;
+    if (f < s)
+        return -1;
+    return 0;
+}
+
+typedef struct {
+    queue_t q;
+    uint32_t messages;
+    int zero_copy_put, zero_copy_get;
+    int error;
+} rbuf_t;
+
+/**
+ * @brief Get timestamp
+ * @return timestamp now
+ */
+uint64_t get_time()
+{
+    struct timespec ts;
+    clock_gettime(0, &ts);
+    return (uint64_t)(ts.tv_sec * 1e6 + ts.tv_nsec / 1e3);
+}
+
+/* The "serializer": message number *n* holds SIZE_OF_MESSAGE increasing values */
+static inline void encode(size_t *dst, size_t n)
+{
+    for (size_t j = 0; j < SIZE_OF_MESSAGE; j++)
+        dst[j] = n * SIZE_OF_MESSAGE + j;
+}
+
+static void *publisher_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t msg[SIZE_OF_MESSAGE];
+    for (size_t i = 0; i < r->messages; i++) {
+        if (r->zero_copy_put) {
+            encode((size_t *) queue_reserve(&r->q, sizeof(msg)), i);
+            queue_commit(&r->q, sizeof(msg));
+        } else {
+            uint8_t *publisher_ptr = (uint8_t *) msg;
+            encode(msg, i);
+            queue_put(&r->q, &publisher_ptr, sizeof(msg));
+        }
+    }
+    return NULL;
+}
+
+static void *consumer_loop(void *arg)
+{
+    rbuf_t *r = (rbuf_t *) arg;
+    size_t buf[SIZE_OF_MESSAGE];
+    for (size_t i = 0; i < r->messages; i++) {
+        const size_t *msg = buf;
+        if (r->zero_copy_get) {
+            queue_peek(&r->q, (const uint8_t **) &msg, sizeof(buf), sizeof(buf));
+        } else {
+            uint8_t *consumer_ptr = (uint8_t *) buf;
+            queue_get(&r->q, &consumer_ptr, sizeof(buf));
+        }
+        if (msg[0] != i * SIZE_OF_MESSAGE || msg[SIZE_OF_MESSAGE - 1] != (i + 1) * SIZE_OF_MESSAGE - 1)
+            r->error = 1;
+        if (r->zero_copy_get)
+            queue_release(&r->q, sizeof(buf));
+    }
+    return NULL;
+}
+
+static long long run(int zero_copy_put, int zero_copy_get, uint32_t messages,
+                     size_t buffer_size)
+{
+    uint32_t time[ROUNDS];
+    for (int i = 0; i < ROUNDS; i++) {
+        rbuf_t r;
+        r.messages = messages;
+        r.zero_copy_put = zero_copy_put;
+        r.zero_copy_get = zero_copy_get;
+        r.error = 0;
+
+        queue_init(&r.q, buffer_size);
+
+        uint64_t start = get_time();
+
+        pthread_t publisher_th, consumer_th;
+        pthread_create(&publisher_th, NULL, &publisher_loop, (void *) &r);
+        pthread_create(&consumer_th, NULL, &consumer_loop, (void *) &r);
+        pthread_join(publisher_th, NULL);
+        pthread_join(consumer_th, NULL);
+
+        time[i] = get_time() - start;
+
+        if (r.error) {
+            fprintf(stderr, "received messages do not match the sent ones\n");
+            exit(1);
+        }
+
+        queue_destroy(&r.q);
+    }
+
+    qsort(time, ROUNDS, sizeof(uint32_t), comp);
+    long long avg = 0LL;
+    for (int num = ROUNDS * 16 / 100; num < ROUNDS * 84 / 100; num++)
+        avg += time[num];
+    return avg / (ROUNDS * 84 / 100 - ROUNDS * 16 / 100);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t messages = 65536U / SIZE_OF_MESSAGE;
+    size_t buffer_size = BUFFER_SIZE;
+
+    /* 'm' prefixes the number of messages, 'b' the buffer size */
+    for (int arg = 1; arg < argc; arg++) {
+        if (argv[arg][0] == 'm')
+            messages = (uint32_t) atoi(argv[arg] + 1);
+        if (argv[arg][0] == 'b')
+            buffer_size = (size_t) atoi(argv[arg] + 1);
+    }
+
+    printf("queue_put     / queue_get  : average run time = %lldus\n",
+           run(0, 0, messages, buffer_size));
+    printf("queue_reserve / queue_get  : average run time = %lldus\n",
+           run(1, 0, messages, buffer_size));
+    printf("queue_reserve / queue_peek : average run time = %lldus\n",
+           run(1, 1, messages, buffer_size));
+
+    return 0;
+}